@@ -0,0 +1,229 @@
+/*
+ *
+ * This file is part of MicroDLNA:
+ * Copyright (c) 2025, Michael Walsh
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The name of the author may not be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dircache.h"
+#include "globalvars.h"
+#include "log.h"
+#include "utils.h"
+
+/* a directory modified this recently may change again within the
+ * resolution of its mtime, so its listing is not kept */
+#define DIRCACHE_SETTLE_TIME 2
+
+struct dircache_entry
+{
+    struct dircache_entry *prev;    /* lru list, most recent first */
+    struct dircache_entry *next;
+    int refs;
+    int linked;
+    size_t bytes;
+    time_t mtime;
+    ino_t ino;
+    dev_t dev;
+    content_entry **entries;
+    int length;
+    char path[];
+};
+
+static pthread_mutex_t dircache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dircache_entry *lru_head = NULL;
+static struct dircache_entry *lru_tail = NULL;
+static size_t cached_bytes = 0;
+
+static void free_entry(struct dircache_entry *e)
+{
+    for (int i = 0; i < e->length; i++)
+        free(e->entries[i]);
+    free(e->entries);
+    free(e);
+}
+
+static void detach_entry(struct dircache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_tail = e->prev;
+
+    e->prev = e->next = NULL;
+}
+
+/* take the entry out of the cache, it lives on until its last user is done */
+static void unlink_entry(struct dircache_entry *e)
+{
+    detach_entry(e);
+    e->linked = 0;
+    cached_bytes -= e->bytes;
+
+    if (e->refs == 0)
+        free_entry(e);
+}
+
+static void link_entry_first(struct dircache_entry *e)
+{
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head)
+        lru_head->prev = e;
+    else
+        lru_tail = e;
+    lru_head = e;
+    e->linked = 1;
+}
+
+static void share_entry(struct dircache_entry *e, directory_listing *dl)
+{
+    e->refs++;
+    dl->entries = e->entries;
+    dl->length = e->length;
+    dl->cached = e;
+}
+
+int dircache_lookup(const char *path, const struct stat *st, directory_listing *dl)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&dircache_lock);
+
+    for (struct dircache_entry * e = lru_head; e != NULL; e = e->next)
+    {
+        if (strcmp(e->path, path) != 0)
+            continue;
+
+        if (e->mtime != st->st_mtime || e->ino != st->st_ino || e->dev != st->st_dev)
+        {
+            PRINT_LOG(E_DEBUG, "dircache: %s changed, rescanning\n", path);
+            unlink_entry(e);
+            break;
+        }
+
+        // move to the front of the lru list
+        if (e != lru_head)
+        {
+            detach_entry(e);
+            link_entry_first(e);
+        }
+
+        share_entry(e, dl);
+        found = 1;
+        break;
+    }
+
+    pthread_mutex_unlock(&dircache_lock);
+
+    return found;
+}
+
+void dircache_insert(const char *path, const struct stat *st, directory_listing *dl)
+{
+    if (dir_cache_size <= 0 || time(NULL) - st->st_mtime < DIRCACHE_SETTLE_TIME)
+        return;
+
+    size_t path_size = strlen(path) + 1;
+    size_t bytes = sizeof(struct dircache_entry) + path_size
+        + dl->length * sizeof(content_entry *);
+    for (int i = 0; i < dl->length; i++)
+        bytes += sizeof(content_entry) + strlen(dl->entries[i]->name) + 1;
+
+    size_t limit = (size_t)dir_cache_size * 1024;
+    if (bytes > limit)
+        return;
+
+    struct dircache_entry *e = safe_malloc(sizeof(struct dircache_entry) + path_size);
+    memset(e, 0, sizeof(struct dircache_entry));
+    memcpy(e->path, path, path_size);
+    e->bytes = bytes;
+    e->mtime = st->st_mtime;
+    e->ino = st->st_ino;
+    e->dev = st->st_dev;
+    e->entries = dl->entries;
+    e->length = dl->length;
+
+    pthread_mutex_lock(&dircache_lock);
+
+    // drop any older listing of the same dir
+    for (struct dircache_entry * old = lru_head; old != NULL; old = old->next)
+    {
+        if (strcmp(old->path, path) == 0)
+        {
+            unlink_entry(old);
+            break;
+        }
+    }
+
+    // evict the least recently used listings to make room
+    while (lru_tail && cached_bytes + bytes > limit)
+        unlink_entry(lru_tail);
+
+    link_entry_first(e);
+    cached_bytes += bytes;
+    share_entry(e, dl);
+
+    PRINT_LOG(E_DEBUG, "dircache: cached %s (%d entries, %zu bytes in use)\n",
+              path, e->length, cached_bytes);
+
+    pthread_mutex_unlock(&dircache_lock);
+}
+
+void dircache_invalidate(const char *path)
+{
+    pthread_mutex_lock(&dircache_lock);
+
+    for (struct dircache_entry * e = lru_head; e != NULL; e = e->next)
+    {
+        if (strcmp(e->path, path) == 0)
+        {
+            PRINT_LOG(E_DEBUG, "dircache: dropped %s\n", path);
+            unlink_entry(e);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&dircache_lock);
+}
+
+void dircache_release(struct dircache_entry *e)
+{
+    pthread_mutex_lock(&dircache_lock);
+
+    e->refs--;
+    if (e->refs == 0 && !e->linked)
+        free_entry(e);
+
+    pthread_mutex_unlock(&dircache_lock);
+}
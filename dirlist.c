@@ -37,10 +37,12 @@
 #include "upnphttp.h"
 #include "globalvars.h"
 #include "dirlist.h"
+#include "dircache.h"
 #include "log.h"
 #include "utils.h"
 #include "mime.h"
 #include "mediadir.h"
+#include "mediaindex.h"
 
 // deline to serve or sort this many files
 #define MAX_FILE_LIMIT 10240
@@ -59,48 +61,39 @@ static int content_entry_compare(const void *aa, const void *bb)
 
 void free_directory_listing(directory_listing *dl)
 {
-    for (int i = 0; i < dl->length; i++)
-        free(dl->entries[i]);
-    free(dl->entries);
+    if (dl->cached)
+    {
+        dircache_release(dl->cached);
+        dl->cached = NULL;
+    }
+    else
+    {
+        for (int i = 0; i < dl->length; i++)
+            free(dl->entries[i]);
+        free(dl->entries);
+    }
 
     dl->length = 0;
     dl->entries = NULL;
 }
 
-int get_directory_listing(struct upnphttp *h, directory_listing *dl)
+/* clip the requested page to the listing */
+static void set_page(struct upnphttp *h, const directory_listing *dl)
 {
-    if (h->requested_count < 1 || h->requested_count > MAX_FILE_LIMIT)
-        h->requested_count = -1;
-
-    if (h->starting_index < 0 || h->starting_index > MAX_FILE_LIMIT)
-        h->starting_index = 0;
-
-    // check for funny file paths
-    if (!sanitise_path(h->remote_dirpath))
+    if (h->requested_count == -1
+        || h->starting_index + h->requested_count > dl->length)
     {
-        PRINT_LOG(E_DEBUG,
-                  "Browsing ContentDirectory failed: addressing out of media dir: ObjectID='%s'\n",
-                  h->remote_dirpath);
-        send_http_response(h, HTTP_FORBIDDEN_403);
-        return 0;
+        h->requested_count = dl->length - h->starting_index;
+        if (h->requested_count < 0)
+            h->requested_count = 0;
     }
+}
 
-    PRINT_LOG(E_DEBUG, "Browsing ContentDirectory:\n"
-              " * ObjectID: %s\n"
-              " * Count: %d\n"
-              " * StartingIndex: %d\n", h->remote_dirpath, h->requested_count,
-              h->starting_index);
-
-    const char *rel_dir = h->remote_dirpath[0] == '\0' ? "." : h->remote_dirpath;
-    DIR *dir;
-
-    if (chdir_to_media_dir() != 0 || !(dir = opendir(rel_dir)))
-    {
-        PRINT_LOG(E_INFO, "Browsing ContentDirectory failed: %s/%s\n", media_dir,
-                  h->remote_dirpath);
-        send_http_response(h, HTTP_SERVICE_UNAVAILABLE_503);
+int scan_directory(const char *rel_dir, directory_listing *dl)
+{
+    DIR *dir = opendir(rel_dir);
+    if (!dir)
         return 0;
-    }
 
     int allocated_entries = 256;
     dl->entries = (content_entry **)safe_malloc(allocated_entries * sizeof(content_entry *));
@@ -150,8 +143,7 @@ int get_directory_listing(struct upnphttp *h, directory_listing *dl)
         {
             free_directory_listing(dl);
             closedir(dir);
-            send_http_response(h, HTTP_INSUFFICIENT_STORAGE_507);
-            return 0;
+            return -1;
         }
 
         dl->entries[dl->length]->type = type;
@@ -175,31 +167,103 @@ int get_directory_listing(struct upnphttp *h, directory_listing *dl)
             {
                 free_directory_listing(dl);
                 closedir(dir);
-                send_http_response(h, HTTP_INSUFFICIENT_STORAGE_507);
-                return 0;
+                return -1;
             }
         }
     }
     closedir(dir);
 
-    if (dl->length == 0)
+    if (dl->length > 0)
     {
-        free_directory_listing(dl);
-        h->requested_count = 0;
+        safe_realloc((void **)&dl->entries, dl->length * sizeof(content_entry *));
+
+        qsort(dl->entries, dl->length, sizeof(content_entry *), content_entry_compare);
+    }
+
+    return 1;
+}
+
+int get_directory_listing(struct upnphttp *h, directory_listing *dl)
+{
+    if (h->requested_count < 1 || h->requested_count > MAX_FILE_LIMIT)
+        h->requested_count = -1;
+
+    if (h->starting_index < 0 || h->starting_index > MAX_FILE_LIMIT)
+        h->starting_index = 0;
+
+    // check for funny file paths
+    if (!sanitise_path(h->remote_dirpath))
+    {
+        PRINT_LOG(E_DEBUG,
+                  "Browsing ContentDirectory failed: addressing out of media dir: ObjectID='%s'\n",
+                  h->remote_dirpath);
+        send_http_response(h, HTTP_FORBIDDEN_403);
+        return 0;
+    }
+
+    PRINT_LOG(E_DEBUG, "Browsing ContentDirectory:\n"
+              " * ObjectID: %s\n"
+              " * Count: %d\n"
+              " * StartingIndex: %d\n", h->remote_dirpath, h->requested_count,
+              h->starting_index);
+
+    const char *rel_dir = h->remote_dirpath[0] == '\0' ? "." : h->remote_dirpath;
+    struct stat dir_st;
+
+    // an indexed dir is served without waking up the media disks
+    int indexed = mediaindex_stat(rel_dir, &dir_st);
+
+    if (chdir_to_media_dir() != 0 || (!indexed && stat(rel_dir, &dir_st) != 0))
+    {
+        PRINT_LOG(E_INFO, "Browsing ContentDirectory failed: %s/%s\n", media_dir,
+                  h->remote_dirpath);
+        send_http_response(h, HTTP_SERVICE_UNAVAILABLE_503);
+        return 0;
+    }
+
+    // pages of an unchanged dir are slices of the cached listing
+    if (dircache_lookup(rel_dir, &dir_st, dl))
+    {
+        set_page(h, dl);
         return 1;
     }
 
-    safe_realloc((void **)&dl->entries, dl->length * sizeof(content_entry *));
+    if (indexed)
+    {
+        if (mediaindex_load(rel_dir, &dir_st, dl))
+            goto listed;
 
-    qsort(dl->entries, dl->length, sizeof(content_entry *), content_entry_compare);
+        // dropped meanwhile, scan the real dir
+        if (stat(rel_dir, &dir_st) != 0)
+        {
+            send_http_response(h, HTTP_SERVICE_UNAVAILABLE_503);
+            return 0;
+        }
+    }
 
-    if (h->requested_count == -1
-        || h->starting_index + h->requested_count > dl->length)
+    int r = scan_directory(rel_dir, dl);
+    if (r <= 0)
     {
-        h->requested_count = dl->length - h->starting_index;
-        if (h->requested_count < 0)
-            h->requested_count = 0;
+        PRINT_LOG(E_INFO, "Browsing ContentDirectory failed: %s/%s\n", media_dir,
+                  h->remote_dirpath);
+        send_http_response(h, r < 0 ? HTTP_INSUFFICIENT_STORAGE_507
+                           : HTTP_SERVICE_UNAVAILABLE_503);
+        return 0;
     }
 
+    mediaindex_store(rel_dir, &dir_st, dl);
+
+listed:
+    if (dl->length == 0)
+    {
+        free_directory_listing(dl);
+        h->requested_count = 0;
+        return 1;
+    }
+
+    dircache_insert(rel_dir, &dir_st, dl);
+
+    set_page(h, dl);
+
     return 1;
 }
@@ -30,6 +30,7 @@
 
 struct upnphttp;
 struct ext_info;
+struct dircache_entry;
 
 typedef enum
 {
@@ -49,8 +50,13 @@ typedef struct
 {
     content_entry **entries;
     int length;
+    struct dircache_entry *cached;  /* shared with the cache when set */
 } directory_listing;
 
 void free_directory_listing(directory_listing *dl);
 
+/* read and sort a dir relative to the current dir, 1 on success,
+ * 0 when it can't be opened, -1 when it is too large */
+int scan_directory(const char *rel_dir, directory_listing *dl);
+
 int get_directory_listing(struct upnphttp *h, directory_listing *dl);
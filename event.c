@@ -0,0 +1,340 @@
+/* Event loop
+ *
+ * Copyright (C) 2025, Michael J. Walsh
+ *
+ * This file is part of MicroDLNA.
+ *
+ * MicroDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MicroDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MicroDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "log.h"
+#include "utils.h"
+
+#ifdef __linux__
+
+/* epoll backend, timers are timerfds living in the same epoll set */
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define MAX_EVENTS 64
+
+static int epfd = -1;
+
+void init_event(void)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        EXIT_ERROR("Failed to create epoll instance: %d\n", errno);
+}
+
+static int epoll_update(struct event_handler *ev, int op, int events)
+{
+    struct epoll_event ee;
+    memset(&ee, 0, sizeof(ee));
+
+    ee.events = EPOLLET;
+    if (events & EVENT_READ)
+        ee.events |= EPOLLIN;
+    if (events & EVENT_WRITE)
+        ee.events |= EPOLLOUT;
+    ee.data.ptr = ev;
+
+    if (epoll_ctl(epfd, op, ev->fd, &ee) < 0)
+    {
+        PRINT_LOG(E_ERROR, "epoll_ctl(%d, %d): %d\n", op, ev->fd, errno);
+        return -1;
+    }
+
+    ev->events = events;
+    return 0;
+}
+
+int event_add(struct event_handler *ev, int events)
+{
+    return epoll_update(ev, EPOLL_CTL_ADD, events);
+}
+
+int event_mod(struct event_handler *ev, int events)
+{
+    return epoll_update(ev, EPOLL_CTL_MOD, events);
+}
+
+void event_del(struct event_handler *ev)
+{
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, ev->fd, NULL) < 0)
+        PRINT_LOG(E_ERROR, "epoll_ctl(DEL, %d): %d\n", ev->fd, errno);
+}
+
+int event_add_timer(struct event_handler *ev, int interval)
+{
+    ev->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ev->fd < 0)
+    {
+        PRINT_LOG(E_ERROR, "timerfd_create(): %d\n", errno);
+        return -1;
+    }
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_sec = interval;
+    its.it_value.tv_sec = interval;
+
+    if (timerfd_settime(ev->fd, 0, &its, NULL) < 0)
+    {
+        PRINT_LOG(E_ERROR, "timerfd_settime(): %d\n", errno);
+        close(ev->fd);
+        ev->fd = -1;
+        return -1;
+    }
+
+    ev->interval = interval;
+    return event_add(ev, EVENT_READ);
+}
+
+void event_del_timer(struct event_handler *ev)
+{
+    event_del(ev);
+    close(ev->fd);
+    ev->fd = -1;
+}
+
+int event_dispatch(void)
+{
+    struct epoll_event ready[MAX_EVENTS];
+
+    int n = epoll_wait(epfd, ready, MAX_EVENTS, -1);
+    if (n < 0)
+    {
+        if (errno == EINTR)
+            return 0;
+        PRINT_LOG(E_ERROR, "epoll_wait(): %d\n", errno);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        struct event_handler *ev = ready[i].data.ptr;
+        int events = 0;
+
+        if (ready[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            events |= EVENT_READ;
+        if (ready[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            events |= EVENT_WRITE;
+
+        if (ev->interval)
+        {
+            uint64_t expirations;
+            if (read(ev->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                continue;
+        }
+
+        ev->process(ev, events);
+    }
+
+    return 0;
+}
+
+#else
+
+/* select backend, handlers may be added from other threads so the
+ * list is locked and a pipe is used to interrupt a pending select */
+
+#include <pthread.h>
+#include <sys/select.h>
+
+static pthread_mutex_t handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct event_handler *handlers = NULL;
+static int wakeup_pipe[2] = { -1, -1 };
+
+void init_event(void)
+{
+    if (pipe(wakeup_pipe) != 0)
+        EXIT_ERROR("Failed to create event pipe: %d\n", errno);
+
+    if (set_non_blocking(wakeup_pipe[0], 1) < 0 || set_non_blocking(wakeup_pipe[1], 1) < 0)
+        EXIT_ERROR("Failed to set event pipe non-blocking\n");
+}
+
+static void wakeup_dispatch(void)
+{
+    char c = 0;
+
+    if (write(wakeup_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+        PRINT_LOG(E_ERROR, "wakeup_dispatch: write(): %d\n", errno);
+}
+
+int event_add(struct event_handler *ev, int events)
+{
+    if (ev->fd >= FD_SETSIZE)
+    {
+        PRINT_LOG(E_ERROR, "event_add: fd %d exceeds FD_SETSIZE\n", ev->fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&handlers_lock);
+    ev->events = events;
+    ev->next = handlers;
+    handlers = ev;
+    pthread_mutex_unlock(&handlers_lock);
+
+    wakeup_dispatch();
+    return 0;
+}
+
+int event_mod(struct event_handler *ev, int events)
+{
+    pthread_mutex_lock(&handlers_lock);
+    ev->events = events;
+    pthread_mutex_unlock(&handlers_lock);
+
+    wakeup_dispatch();
+    return 0;
+}
+
+void event_del(struct event_handler *ev)
+{
+    pthread_mutex_lock(&handlers_lock);
+    for (struct event_handler ** cur = &handlers; *cur != NULL; cur = &(*cur)->next)
+    {
+        if (*cur == ev)
+        {
+            *cur = ev->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&handlers_lock);
+}
+
+int event_add_timer(struct event_handler *ev, int interval)
+{
+    ev->fd = -1;
+    ev->interval = interval;
+    ev->deadline = time(NULL) + interval;
+
+    pthread_mutex_lock(&handlers_lock);
+    ev->events = 0;
+    ev->next = handlers;
+    handlers = ev;
+    pthread_mutex_unlock(&handlers_lock);
+
+    return 0;
+}
+
+void event_del_timer(struct event_handler *ev)
+{
+    event_del(ev);
+}
+
+int event_dispatch(void)
+{
+    struct
+    {
+        struct event_handler *ev;
+        int events;
+    } ready[FD_SETSIZE];
+    int n_ready = 0;
+
+    fd_set readset, writeset;
+    FD_ZERO(&readset);
+    FD_ZERO(&writeset);
+
+    FD_SET(wakeup_pipe[0], &readset);
+    int max_fd = wakeup_pipe[0];
+
+    time_t now = time(NULL);
+    long timeout = -1;
+
+    pthread_mutex_lock(&handlers_lock);
+    for (struct event_handler * ev = handlers; ev != NULL; ev = ev->next)
+    {
+        if (ev->interval)
+        {
+            long left = ev->deadline > now ? (long)(ev->deadline - now) : 0;
+            if (timeout < 0 || left < timeout)
+                timeout = left;
+            continue;
+        }
+
+        if (ev->events & EVENT_READ)
+            FD_SET(ev->fd, &readset);
+        if (ev->events & EVENT_WRITE)
+            FD_SET(ev->fd, &writeset);
+        if (ev->events && ev->fd > max_fd)
+            max_fd = ev->fd;
+    }
+    pthread_mutex_unlock(&handlers_lock);
+
+    struct timeval tv = { timeout, 0 };
+    int n = select(max_fd + 1, &readset, &writeset, NULL, timeout < 0 ? NULL : &tv);
+    if (n < 0)
+    {
+        if (errno == EINTR)
+            return 0;
+        PRINT_LOG(E_ERROR, "select(): %d\n", errno);
+        return -1;
+    }
+
+    if (FD_ISSET(wakeup_pipe[0], &readset))
+    {
+        char buf[32];
+        while (read(wakeup_pipe[0], buf, sizeof(buf)) > 0)
+            ;
+    }
+
+    // collect first, handlers are free to remove themselves
+    now = time(NULL);
+
+    pthread_mutex_lock(&handlers_lock);
+    for (struct event_handler * ev = handlers; ev != NULL && n_ready < FD_SETSIZE; ev = ev->next)
+    {
+        int events = 0;
+
+        if (ev->interval)
+        {
+            if (now >= ev->deadline)
+            {
+                ev->deadline = now + ev->interval;
+                events = EVENT_READ;
+            }
+        }
+        else
+        {
+            if ((ev->events & EVENT_READ) && FD_ISSET(ev->fd, &readset))
+                events |= EVENT_READ;
+            if ((ev->events & EVENT_WRITE) && FD_ISSET(ev->fd, &writeset))
+                events |= EVENT_WRITE;
+        }
+
+        if (events)
+        {
+            ready[n_ready].ev = ev;
+            ready[n_ready].events = events;
+            n_ready++;
+        }
+    }
+    pthread_mutex_unlock(&handlers_lock);
+
+    for (int i = 0; i < n_ready; i++)
+        ready[i].ev->process(ready[i].ev, ready[i].events);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+/* Event loop
+ *
+ * Copyright (C) 2025, Michael J. Walsh
+ *
+ * This file is part of MicroDLNA.
+ *
+ * MicroDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MicroDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MicroDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+
+#define EVENT_READ  0x01
+#define EVENT_WRITE 0x02
+
+/* Readiness is reported edge-triggered: a handler must consume
+ * everything available (read/accept until EAGAIN) before returning.
+ * A handler may remove and free itself from its process callback,
+ * but must not free any other handler. */
+struct event_handler
+{
+    int fd;
+    void (*process)(struct event_handler *ev, int events);
+
+    /* private to event.c */
+    int events;
+    int interval;
+    time_t deadline;
+    struct event_handler *next;
+};
+
+void init_event(void);
+
+int event_add(struct event_handler *ev, int events);
+
+int event_mod(struct event_handler *ev, int events);
+
+void event_del(struct event_handler *ev);
+
+/* periodic timer firing every interval seconds, fd is managed here */
+int event_add_timer(struct event_handler *ev, int interval);
+
+/* stop a timer, it may be added again later */
+void event_del_timer(struct event_handler *ev);
+
+/* wait once and run the handlers that are ready, -1 on fatal error */
+int event_dispatch(void);
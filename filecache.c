@@ -0,0 +1,297 @@
+/*
+ *
+ * This file is part of MicroDLNA:
+ * Copyright (c) 2025, Michael Walsh
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The name of the author may not be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filecache.h"
+#include "log.h"
+#include "utils.h"
+
+/* Players seeking through a file send one Range request after the
+ * other for it, so the descriptor, size, mime type and subtitles of
+ * the most recently served files are kept. Each request still stats
+ * the path to see if the file was replaced. */
+
+/* open descriptors kept for files no request is using */
+#define FILECACHE_FILES 32
+/* subtitles may appear next to an unchanged video, look again after */
+#define FILECACHE_MAX_AGE 30
+
+struct filecache_entry
+{
+    struct filecache_entry *prev;   /* lru list, most recent first */
+    struct filecache_entry *next;
+    int refs;
+    int linked;
+    int fd;
+    off_t size;
+    time_t mtime;
+    ino_t ino;
+    dev_t dev;
+    time_t opened;
+    const struct ext_info *mime;
+    char *srt_path;
+    char path[];
+};
+
+static pthread_mutex_t filecache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct filecache_entry *lru_head = NULL;
+static struct filecache_entry *lru_tail = NULL;
+static int cached_files = 0;
+
+static void free_entry(struct filecache_entry *e)
+{
+    close(e->fd);
+    free(e->srt_path);
+    free(e);
+}
+
+static void detach_entry(struct filecache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_tail = e->prev;
+
+    e->prev = e->next = NULL;
+}
+
+/* take the entry out of the cache, it lives on until its last user is done */
+static void unlink_entry(struct filecache_entry *e)
+{
+    detach_entry(e);
+    e->linked = 0;
+    cached_files--;
+
+    if (e->refs == 0)
+        free_entry(e);
+}
+
+static void link_entry_first(struct filecache_entry *e)
+{
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head)
+        lru_head->prev = e;
+    else
+        lru_tail = e;
+    lru_head = e;
+    e->linked = 1;
+}
+
+static void share_entry(struct filecache_entry *e, struct cached_file *f)
+{
+    e->refs++;
+    f->fd = e->fd;
+    f->size = e->size;
+    f->mime = e->mime;
+    f->srt_path = e->srt_path;
+    f->cached = e;
+}
+
+/* sanitised paths may hold empty components, the key has none */
+static void make_key(char *key, const char *path)
+{
+    size_t n = 0;
+
+    for (const char *p = path; *p && n < PATH_MAX - 1; p++)
+    {
+        if (*p == '/' && (n == 0 || key[n - 1] == '/'))
+            continue;
+        key[n++] = *p;
+    }
+    if (n > 0 && key[n - 1] == '/')
+        n--;
+    key[n] = '\0';
+}
+
+static char *get_srt_path(const char *file_path)
+{
+    int len = strlen(file_path);
+    int end = len > 7 ? len - 7 : 0;
+
+    for (int i = len - 1; i > end; i--)
+    {
+        if (file_path[i] == '.')
+        {
+            char *p = safe_malloc(i + 5);
+            memcpy(p, file_path, i + 1);
+            memcpy(p + i + 1, "srt", 4);
+            return p;
+        }
+        else if (file_path[i] == '/')
+            return NULL;
+    }
+    return NULL;
+}
+
+int filecache_open(const char *path, const char *fullpath, const struct stat *st,
+                   struct cached_file *f)
+{
+    char key[PATH_MAX];
+    make_key(key, path);
+
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&filecache_lock);
+
+    for (struct filecache_entry * e = lru_head; e != NULL; e = e->next)
+    {
+        if (strcmp(e->path, key) != 0)
+            continue;
+
+        if (e->mtime != st->st_mtime || e->size != st->st_size || e->ino != st->st_ino
+            || e->dev != st->st_dev || now - e->opened >= FILECACHE_MAX_AGE)
+        {
+            PRINT_LOG(E_DEBUG, "filecache: %s changed, reopening\n", key);
+            unlink_entry(e);
+            break;
+        }
+
+        if (e != lru_head)
+        {
+            detach_entry(e);
+            link_entry_first(e);
+        }
+
+        share_entry(e, f);
+        pthread_mutex_unlock(&filecache_lock);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&filecache_lock);
+
+    int fd = open(fullpath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    size_t key_size = strlen(key) + 1;
+    struct filecache_entry *e = safe_malloc(sizeof(struct filecache_entry) + key_size);
+    memset(e, 0, sizeof(struct filecache_entry));
+    memcpy(e->path, key, key_size);
+    e->fd = fd;
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->ino = st->st_ino;
+    e->dev = st->st_dev;
+    e->opened = now;
+    e->mime = get_mime_type(key);
+
+    // subtitles are looked up relative to media_dir, the working directory
+    if (e->mime && e->mime->type == M_VIDEO)
+    {
+        e->srt_path = get_srt_path(key);
+        if (e->srt_path && access(e->srt_path, R_OK) != 0)
+        {
+            free(e->srt_path);
+            e->srt_path = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&filecache_lock);
+
+    // another thread may have opened the same file meanwhile
+    for (struct filecache_entry * old = lru_head; old != NULL; old = old->next)
+    {
+        if (strcmp(old->path, key) == 0)
+        {
+            unlink_entry(old);
+            break;
+        }
+    }
+
+    // evict the least recently used files, those still being sent
+    // stay open until their transfer is done
+    while (lru_tail && cached_files >= FILECACHE_FILES)
+        unlink_entry(lru_tail);
+
+    link_entry_first(e);
+    cached_files++;
+    share_entry(e, f);
+
+    pthread_mutex_unlock(&filecache_lock);
+
+    return 0;
+}
+
+void filecache_close(struct cached_file *f)
+{
+    struct filecache_entry *e = f->cached;
+
+    if (e == NULL)
+        return;
+
+    pthread_mutex_lock(&filecache_lock);
+
+    e->refs--;
+    if (e->refs == 0 && !e->linked)
+        free_entry(e);
+
+    pthread_mutex_unlock(&filecache_lock);
+
+    f->cached = NULL;
+    f->fd = -1;
+}
+
+void filecache_invalidate_dir(const char *dir)
+{
+    char key[PATH_MAX];
+    make_key(key, strcmp(dir, ".") == 0 ? "" : dir);
+    size_t len = strlen(key);
+
+    pthread_mutex_lock(&filecache_lock);
+
+    struct filecache_entry *e = lru_head;
+    while (e != NULL)
+    {
+        struct filecache_entry *next = e->next;
+        const char *slash = strrchr(e->path, '/');
+        size_t dir_len = slash ? (size_t)(slash - e->path) : 0;
+
+        if (dir_len == len && strncmp(e->path, key, len) == 0)
+        {
+            PRINT_LOG(E_DEBUG, "filecache: dropped %s\n", e->path);
+            unlink_entry(e);
+        }
+        e = next;
+    }
+
+    pthread_mutex_unlock(&filecache_lock);
+}
@@ -0,0 +1,58 @@
+#pragma once
+/*
+ *
+ * This file is part of MicroDLNA:
+ * Copyright (c) 2025, Michael Walsh
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The name of the author may not be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "mime.h"
+
+struct filecache_entry;
+
+/* a media file opened through the cache, fd may be shared with other
+ * threads and must only be read at explicit offsets */
+struct cached_file
+{
+    int fd;
+    off_t size;
+    const struct ext_info *mime;    /* NULL if the type is unknown */
+    const char *srt_path;           /* subtitles next to a video, or NULL */
+    struct filecache_entry *cached;
+};
+
+/* path is relative to media_dir and st is its fresh stat(), an open
+ * descriptor is shared while the file keeps the same inode, size and
+ * mtime, -1 with errno if the file cannot be opened */
+int filecache_open(const char *path, const char *fullpath, const struct stat *st,
+                   struct cached_file *f);
+
+void filecache_close(struct cached_file *f);
+
+/* forget the files of a directory, "." for the root of media_dir */
+void filecache_invalidate_dir(const char *dir);
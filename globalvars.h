@@ -29,10 +29,30 @@ extern int notify_interval;     /* seconds between SSDP announces */
 
 extern int max_connections;     /* max number of simultaneous conenctions */
 
+extern int queue_depth;         /* connections waiting for a free worker */
+
+extern int max_chunk_size;      /* KiB, largest HTTP chunk sent */
+
+extern int content_length_responses;    /* send small bodies with a Content-Length */
+
+extern int max_client_rate;     /* KiB/s per file transfer, 0 for no limit */
+
+extern int max_total_rate;      /* KiB/s shared by all file transfers */
+
+extern int use_io_uring;        /* move file transfers to the io_uring engine */
+
 extern int mode_systemd;        /* systemd-compatible mode or not */
 
 extern char friendly_name[];    /* hostname or user preference */
 
 extern char *media_dir;         /* path to the media directory */
 
+extern int dir_cache_size;      /* KiB of directory listings kept in memory */
+
+extern int watch_media;         /* follow media_dir changes with inotify */
+
+extern char *state_dir;         /* where the media index is kept */
+
+extern int enable_search;       /* answer Search from a name index */
+
 extern char uuidvalue[];        /* uuid identifier, includes uuid: prefix */
@@ -0,0 +1,610 @@
+/*
+ *
+ * This file is part of MicroDLNA:
+ * Copyright (c) 2025, Michael Walsh
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The name of the author may not be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "globalvars.h"
+#include "iouring.h"
+#include "log.h"
+#include "utils.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* One thread owns the ring and moves every file through a registered
+ * buffer: a fixed read of the next block is linked to the send of it,
+ * so each block costs the engine one submission and two completions
+ * whatever the number of streams. Workers queue a transfer, wake the
+ * engine through an eventfd it keeps a read pending on, and sleep
+ * until their transfer is finished. */
+
+/* registered buffer of each transfer, there is one per worker */
+#define IOURING_BLOCK_SIZE (128 << 10)
+/* pages this far behind the socket are kept for clients stepping back */
+#define DROP_BEHIND_WINDOW (8 << 20)
+
+/* low bits of user_data tell which operation completed */
+#define TAG_NONE 0
+#define TAG_READ 1
+#define TAG_SEND 2
+#define TAG_WAKE 3
+#define TAG_MASK 3
+
+struct uring_transfer
+{
+    int sd;
+    int fd;
+    int drop_behind;
+    off_t offset;       // first byte of the current block
+    off_t end;          // last byte to send
+    off_t dropped;      // pages below here were dropped
+    int buf;            // registered buffer index
+    int read_res;       // result of the read of the current block
+    unsigned int len;   // bytes of the current block
+    unsigned int sent;  // bytes of the block already sent
+
+    int result;
+    int done;
+    pthread_cond_t cond;
+    struct uring_transfer *next;
+};
+
+struct uring
+{
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_local_tail;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static struct uring ring = { .fd = -1 };
+static int engine_ready = 0;
+static int wake_fd = -1;
+static uint64_t wake_count;
+
+static char *buffers = NULL;
+static int *free_buffers = NULL;
+static int n_free_buffers = 0;
+
+static pthread_mutex_t transfers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct uring_transfer *incoming = NULL;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                              unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int ring_setup(unsigned int entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+
+    ring.fd = sys_io_uring_setup(entries, &p);
+    if (ring.fd < 0)
+    {
+        PRINT_LOG(E_ERROR, "io_uring_setup(): %d\n", errno);
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size)
+        sq_size = cq_size;
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        PRINT_LOG(E_ERROR, "mmap(io_uring sq): %d\n", errno);
+        return -1;
+    }
+
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+        {
+            PRINT_LOG(E_ERROR, "mmap(io_uring cq): %d\n", errno);
+            return -1;
+        }
+    }
+
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                     IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+    {
+        PRINT_LOG(E_ERROR, "mmap(io_uring sqes): %d\n", errno);
+        return -1;
+    }
+
+    ring.sq_entries = p.sq_entries;
+    ring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring.sq_local_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // sqes are used in ring order
+    for (unsigned int i = 0; i < p.sq_entries; i++)
+        ring.sq_array[i] = i;
+
+    return 0;
+}
+
+/* the engine needs fixed reads, sends and advice */
+static int ring_supports_ops(void)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = safe_malloc(size);
+    memset(probe, 0, size);
+
+    int ok = sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    if (ok)
+    {
+        const int ops[] = { IORING_OP_READ_FIXED, IORING_OP_SEND, IORING_OP_READ,
+                            IORING_OP_FADVISE };
+
+        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+        {
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                ok = 0;
+        }
+    }
+
+    free(probe);
+    return ok;
+}
+
+static int register_buffers(int count)
+{
+    buffers = safe_malloc((size_t)count * IOURING_BLOCK_SIZE);
+    free_buffers = safe_malloc(count * sizeof(int));
+
+    struct iovec *iov = safe_malloc(count * sizeof(struct iovec));
+    for (int i = 0; i < count; i++)
+    {
+        iov[i].iov_base = buffers + (size_t)i * IOURING_BLOCK_SIZE;
+        iov[i].iov_len = IOURING_BLOCK_SIZE;
+        free_buffers[i] = i;
+    }
+    n_free_buffers = count;
+
+    int r = sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, iov, count);
+    if (r < 0)
+        PRINT_LOG(E_ERROR, "io_uring_register(buffers): %d\n", errno);
+
+    free(iov);
+    return r;
+}
+
+/* hand the queued sqes to the kernel and wait for wait_nr completions */
+static void ring_enter(unsigned int wait_nr)
+{
+    unsigned int to_submit = ring.sq_local_tail - *ring.sq_tail;
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+
+    while (sys_io_uring_enter(ring.fd, to_submit, wait_nr,
+                              wait_nr ? IORING_ENTER_GETEVENTS : 0) < 0)
+    {
+        // completions must be reaped before submitting more
+        if (errno == EBUSY || errno == EAGAIN)
+            return;
+        if (errno != EINTR)
+            EXIT_ERROR("io_uring_enter(): %d\n", errno);
+    }
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+    unsigned int head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring.sq_local_tail - head >= ring.sq_entries)
+    {
+        ring_enter(0);
+        head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        if (ring.sq_local_tail - head >= ring.sq_entries)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring.sqes[ring.sq_local_tail & *ring.sq_mask];
+    ring.sq_local_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* the ring holds four entries per worker, it only fills up when the
+ * kernel is not consuming submissions at all */
+static struct io_uring_sqe *wait_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    while ((sqe = get_sqe()) == NULL)
+        usleep(1000);
+
+    return sqe;
+}
+
+static void queue_wake_read(void)
+{
+    struct io_uring_sqe *sqe = wait_sqe();
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = (uintptr_t)&wake_count;
+    sqe->len = sizeof(wake_count);
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = TAG_WAKE;
+}
+
+static void queue_advice(struct uring_transfer *t, off_t offset, off_t len, int advice)
+{
+    struct io_uring_sqe *sqe = wait_sqe();
+
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = t->fd;
+    sqe->off = (uint64_t)offset;
+    sqe->len = (uint32_t)len;
+    sqe->fadvise_advice = (uint32_t)advice;
+    sqe->user_data = TAG_NONE;
+}
+
+static void queue_send(struct uring_transfer *t)
+{
+    struct io_uring_sqe *sqe = wait_sqe();
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = t->sd;
+    sqe->addr = (uintptr_t)(buffers + (size_t)t->buf * IOURING_BLOCK_SIZE + t->sent);
+    sqe->len = t->len - t->sent;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uintptr_t)t | TAG_SEND;
+}
+
+/* read the next block and send it once the read is done */
+static void queue_block(struct uring_transfer *t)
+{
+    off_t left = t->end - t->offset + 1;
+
+    t->len = left > IOURING_BLOCK_SIZE ? IOURING_BLOCK_SIZE : (unsigned int)left;
+    t->sent = 0;
+    t->read_res = 0;
+
+    // the linked pair must go to the kernel in the same submission
+    if (ring.sq_local_tail + 2 - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > ring.sq_entries)
+        ring_enter(0);
+
+    struct io_uring_sqe *sqe = wait_sqe();
+
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = t->fd;
+    sqe->off = (uint64_t)t->offset;
+    sqe->addr = (uintptr_t)(buffers + (size_t)t->buf * IOURING_BLOCK_SIZE);
+    sqe->len = t->len;
+    sqe->buf_index = (uint16_t)t->buf;
+    sqe->user_data = (uintptr_t)t | TAG_READ;
+
+    queue_send(t);
+}
+
+static void finish(struct uring_transfer *t, int result)
+{
+    free_buffers[n_free_buffers++] = t->buf;
+
+    pthread_mutex_lock(&transfers_lock);
+    t->result = result;
+    t->done = 1;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&transfers_lock);
+}
+
+static void start_transfer(struct uring_transfer *t)
+{
+    if (n_free_buffers == 0)
+    {
+        // cannot happen with one buffer per worker, but stay safe
+        pthread_mutex_lock(&transfers_lock);
+        t->result = 1;
+        t->done = 1;
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&transfers_lock);
+        return;
+    }
+
+    t->buf = free_buffers[--n_free_buffers];
+    t->dropped = t->offset;
+    queue_block(t);
+}
+
+static void block_sent(struct uring_transfer *t)
+{
+    t->offset += t->len;
+
+#ifdef POSIX_FADV_DONTNEED
+    if (t->drop_behind && t->offset - t->dropped > 2 * DROP_BEHIND_WINDOW)
+    {
+        off_t upto = t->offset - DROP_BEHIND_WINDOW;
+        queue_advice(t, t->dropped, upto - t->dropped, POSIX_FADV_DONTNEED);
+        t->dropped = upto;
+    }
+#endif
+
+    if (t->offset > t->end)
+        finish(t, 0);
+    else
+        queue_block(t);
+}
+
+static void send_done(struct uring_transfer *t, int res)
+{
+    if (res == -ECANCELED)
+    {
+        // the read came back short or failed and broke the link
+        if (t->read_res > 0)
+        {
+            t->len = (unsigned int)t->read_res;
+            queue_send(t);
+        }
+        else if (t->read_res == 0)
+        {
+            PRINT_LOG(E_DEBUG, "io_uring read :: unexpected end of file\n");
+            finish(t, -1);
+        }
+        else
+        {
+            // the block is still unsent, the worker can take over from here
+            PRINT_LOG(E_DEBUG, "io_uring read error :: error no. %d\n", -t->read_res);
+            finish(t, 1);
+        }
+        return;
+    }
+
+    if (res < 0)
+    {
+        PRINT_LOG(E_DEBUG, "io_uring send error :: error no. %d\n", -res);
+        t->offset += t->sent;
+        finish(t, -1);
+        return;
+    }
+
+    t->sent += (unsigned int)res;
+    if (res == 0)
+    {
+        finish(t, -1);
+        return;
+    }
+
+    if (t->sent < t->len)
+        queue_send(t);
+    else
+        block_sent(t);
+}
+
+static void start_incoming(void)
+{
+    pthread_mutex_lock(&transfers_lock);
+    struct uring_transfer *list = incoming;
+    incoming = NULL;
+    pthread_mutex_unlock(&transfers_lock);
+
+    while (list != NULL)
+    {
+        struct uring_transfer *t = list;
+        list = t->next;
+        start_transfer(t);
+    }
+}
+
+static void *engine_thread(void *unused)
+{
+    queue_wake_read();
+
+    for (;;)
+    {
+        ring_enter(1);
+
+        unsigned int head = *ring.cq_head;
+        unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            uint64_t tag = cqe->user_data & TAG_MASK;
+            struct uring_transfer *t = (struct uring_transfer *)(uintptr_t)(cqe->user_data & ~(uint64_t)TAG_MASK);
+            int res = cqe->res;
+
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+            switch (tag)
+            {
+            case TAG_READ:
+                t->read_res = res;
+                break;
+
+            case TAG_SEND:
+                send_done(t, res);
+                break;
+
+            case TAG_WAKE:
+                if (res < 0 && res != -EINTR && res != -EAGAIN)
+                    EXIT_ERROR("io_uring eventfd read: %d\n", -res);
+                queue_wake_read();
+                start_incoming();
+                break;
+
+            default:
+                break;
+            }
+
+            tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    return NULL;
+}
+
+void init_iouring(void)
+{
+    if (!use_io_uring)
+        return;
+
+    // every worker may have a read, a send, an advice and some slack queued
+    if (ring_setup(4 * max_connections + 4) < 0 || !ring_supports_ops())
+    {
+        PRINT_LOG(E_ERROR, "io_uring is not usable, transfers stay on the workers\n");
+        return;
+    }
+
+    if (register_buffers(max_connections) < 0)
+    {
+        PRINT_LOG(E_ERROR, "Failed to register io_uring buffers, transfers stay on the workers\n");
+        return;
+    }
+
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0)
+    {
+        PRINT_LOG(E_ERROR, "eventfd(): %d\n", errno);
+        return;
+    }
+
+    pthread_attr_t thread_attrs;
+    pthread_attr_init(&thread_attrs);
+    pthread_attr_setdetachstate(&thread_attrs, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thr;
+    int r = pthread_create(&thr, &thread_attrs, engine_thread, NULL);
+    pthread_attr_destroy(&thread_attrs);
+    if (r != 0)
+    {
+        PRINT_LOG(E_ERROR, "Failed to start the io_uring thread: %d\n", r);
+        return;
+    }
+
+    engine_ready = 1;
+    PRINT_LOG(E_INFO, "io_uring transfers enabled, %d buffers of %d KiB\n",
+              max_connections, IOURING_BLOCK_SIZE >> 10);
+}
+
+int iouring_send_file(int socketfd, int sendfd, off_t *offset, off_t end_offset,
+                      int drop_behind)
+{
+    if (!engine_ready)
+        return 1;
+
+    struct uring_transfer t;
+    memset(&t, 0, sizeof(t));
+    t.sd = socketfd;
+    t.fd = sendfd;
+    t.drop_behind = drop_behind;
+    t.offset = *offset;
+    t.end = end_offset;
+    pthread_cond_init(&t.cond, NULL);
+
+    pthread_mutex_lock(&transfers_lock);
+    t.next = incoming;
+    incoming = &t;
+    pthread_mutex_unlock(&transfers_lock);
+
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+        PRINT_LOG(E_ERROR, "iouring_send_file: write(): %d\n", errno);
+
+    pthread_mutex_lock(&transfers_lock);
+    while (!t.done)
+        pthread_cond_wait(&t.cond, &transfers_lock);
+    pthread_mutex_unlock(&transfers_lock);
+
+    pthread_cond_destroy(&t.cond);
+
+    *offset = t.offset;
+    return t.result;
+}
+
+#else
+
+void init_iouring(void)
+{
+    if (use_io_uring)
+        PRINT_LOG(E_ERROR, "io_uring is not available, ignored\n");
+}
+
+int iouring_send_file(int socketfd, int sendfd, off_t *offset, off_t end_offset,
+                      int drop_behind)
+{
+    return 1;
+}
+
+#endif
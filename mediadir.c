@@ -27,6 +27,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -35,15 +36,23 @@
 #include "utils.h"
 #include "globalvars.h"
 
+static pthread_mutex_t media_dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int chdir_to_media_dir(void)
 {
     static int is_real = 0;
 
+    // requests are served from several threads, only one of them may
+    // swap media_dir for its real path
+    pthread_mutex_lock(&media_dir_lock);
     if (!is_real)
     {
         char *new_media_dir = realpath(media_dir, NULL);
         if (!new_media_dir)
+        {
+            pthread_mutex_unlock(&media_dir_lock);
             return -1;
+        }
 
         // probably unnecessary
         safe_realloc((void **)&new_media_dir, strlen(new_media_dir) + 1);
@@ -52,6 +61,7 @@ int chdir_to_media_dir(void)
         media_dir = new_media_dir;
         is_real = 1;
     }
+    pthread_mutex_unlock(&media_dir_lock);
 
     return chdir(media_dir);
 }
@@ -0,0 +1,705 @@
+/*
+ *
+ * This file is part of MicroDLNA:
+ * Copyright (c) 2025, Michael Walsh
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The name of the author may not be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mediaindex.h"
+#include "dircache.h"
+#include "event.h"
+#include "globalvars.h"
+#include "log.h"
+#include "mediadir.h"
+#include "mime.h"
+#include "threads.h"
+#include "utils.h"
+
+/* Index file layout, all numbers in host byte order:
+ *
+ *   header
+ *   directory records, each followed by its path and its sorted entries
+ *   table of record offsets sorted by path, for bsearch
+ *
+ * The file is only ever replaced as a whole, new listings collect in
+ * memory until the next save. */
+
+#define INDEX_MAGIC "MDLNAIX1"
+#define INDEX_FILE "index"
+
+/* seconds between writing collected changes back */
+#define INDEX_SAVE_INTERVAL 300
+
+/* an indexed dir is checked against the disk at most this often */
+#define INDEX_RECHECK_INTERVAL 60
+#define RECHECK_SLOTS 1024
+
+/* same as the dir cache, a dir this fresh may change within its mtime */
+#define INDEX_SETTLE_TIME 2
+
+#define INDEX_MIME_DIR 0xffff
+
+struct index_header
+{
+    char magic[8];
+    uint32_t mime_check;
+    uint32_t n_dirs;
+    uint64_t table_off;
+};
+
+struct index_dir_rec
+{
+    int64_t mtime;
+    uint64_t ino;
+    uint64_t dev;
+    uint32_t n_entries;
+    uint32_t path_len;          /* including the trailing nul */
+};
+
+struct index_entry_rec
+{
+    uint64_t size;
+    uint16_t mime;
+    uint16_t name_len;          /* including the trailing nul */
+    uint32_t pad;
+};
+
+/* listings stored or dropped since the file was written */
+struct overlay_dir
+{
+    struct overlay_dir *next;
+    unsigned char *rec;         /* NULL when dropped */
+    size_t len;
+    char path[];
+};
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *index_path = NULL;
+static const unsigned char *map = NULL;
+static size_t map_size = 0;
+static uint32_t map_dirs = 0;
+static uint64_t map_table = 0;
+
+static struct overlay_dir *overlay = NULL;
+static int dirty = 0;
+
+static struct
+{
+    uint32_t hash;
+    time_t checked;
+} rechecks[RECHECK_SLOTS];
+
+static struct event_handler save_timer;
+
+/* check a record and locate its path and entries, 0 if malformed */
+static int parse_record(const unsigned char *p, const unsigned char *end,
+                        struct index_dir_rec *hdr, const char **path,
+                        const unsigned char **entries)
+{
+    if ((size_t)(end - p) < sizeof(*hdr))
+        return 0;
+    memcpy(hdr, p, sizeof(*hdr));
+    p += sizeof(*hdr);
+
+    if (hdr->path_len == 0 || (size_t)(end - p) < hdr->path_len
+        || p[hdr->path_len - 1] != '\0')
+        return 0;
+
+    *path = (const char *)p;
+    *entries = p + hdr->path_len;
+    return 1;
+}
+
+/* next entry, NULL past the end of the mapping */
+static const unsigned char *parse_entry(const unsigned char *p, const unsigned char *end,
+                                        struct index_entry_rec *e, const char **name)
+{
+    if ((size_t)(end - p) < sizeof(*e))
+        return NULL;
+    memcpy(e, p, sizeof(*e));
+    p += sizeof(*e);
+
+    if (e->name_len == 0 || (size_t)(end - p) < e->name_len || p[e->name_len - 1] != '\0')
+        return NULL;
+
+    *name = (const char *)p;
+    return p + e->name_len;
+}
+
+/* total size of a record, 0 if malformed */
+static size_t record_length(const unsigned char *p, const unsigned char *end)
+{
+    struct index_dir_rec hdr;
+    const char *path;
+    const unsigned char *q;
+
+    if (!parse_record(p, end, &hdr, &path, &q))
+        return 0;
+
+    for (uint32_t i = 0; i < hdr.n_entries; i++)
+    {
+        struct index_entry_rec e;
+        const char *name;
+
+        if (!(q = parse_entry(q, end, &e, &name)))
+            return 0;
+    }
+
+    return q - p;
+}
+
+static const unsigned char *map_record(uint32_t i)
+{
+    uint64_t off;
+    memcpy(&off, map + map_table + i * sizeof(off), sizeof(off));
+
+    return off < map_size ? map + off : NULL;
+}
+
+static const char *map_record_path(uint32_t i)
+{
+    const unsigned char *p = map_record(i);
+    struct index_dir_rec hdr;
+    const char *path;
+    const unsigned char *entries;
+
+    if (!p || !parse_record(p, map + map_size, &hdr, &path, &entries))
+        return NULL;
+    return path;
+}
+
+static struct overlay_dir *find_overlay(const char *path)
+{
+    for (struct overlay_dir * o = overlay; o != NULL; o = o->next)
+        if (strcmp(o->path, path) == 0)
+            return o;
+    return NULL;
+}
+
+/* the current record of path and the end of its buffer, called with index_lock held */
+static const unsigned char *find_record(const char *path, const unsigned char **end)
+{
+    const struct overlay_dir *o = find_overlay(path);
+    if (o)
+    {
+        *end = o->rec + o->len;
+        return o->rec;
+    }
+
+    uint32_t lo = 0, hi = map_dirs;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const char *p = map_record_path(mid);
+        if (!p)
+            return NULL;
+
+        int c = strcmp(path, p);
+        if (c == 0)
+        {
+            *end = map + map_size;
+            return map_record(mid);
+        }
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return NULL;
+}
+
+/* replace the overlay entry of path, rec NULL drops the listing */
+static void overlay_put(const char *path, unsigned char *rec, size_t len)
+{
+    struct overlay_dir *o = find_overlay(path);
+
+    if (!o)
+    {
+        size_t path_size = strlen(path) + 1;
+        o = safe_malloc(sizeof(struct overlay_dir) + path_size);
+        memcpy(o->path, path, path_size);
+        o->next = overlay;
+        overlay = o;
+    }
+    else
+        free(o->rec);
+
+    o->rec = rec;
+    o->len = len;
+    dirty = 1;
+}
+
+static void unmap_index(void)
+{
+    if (map)
+        munmap((void *)map, map_size);
+    map = NULL;
+    map_size = 0;
+    map_dirs = 0;
+    map_table = 0;
+}
+
+static void map_index(void)
+{
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+            PRINT_LOG(E_ERROR, "Failed to open media index %s: %d\n", index_path, errno);
+        return;
+    }
+
+    struct stat st;
+    struct index_header hdr;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(hdr))
+    {
+        close(fd);
+        return;
+    }
+
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        PRINT_LOG(E_ERROR, "Failed to map media index %s: %d\n", index_path, errno);
+        return;
+    }
+
+    memcpy(&hdr, p, sizeof(hdr));
+
+    if (memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) != 0
+        || hdr.mime_check != get_mime_table_check()
+        || hdr.table_off < sizeof(hdr) || hdr.table_off > (uint64_t)st.st_size
+        || ((uint64_t)st.st_size - hdr.table_off) / sizeof(uint64_t) < hdr.n_dirs)
+    {
+        PRINT_LOG(E_INFO, "Ignoring outdated media index %s\n", index_path);
+        munmap(p, st.st_size);
+        return;
+    }
+
+    map = p;
+    map_size = st.st_size;
+    map_dirs = hdr.n_dirs;
+    map_table = hdr.table_off;
+
+    // lookups jump around the file, readahead would only fill the page cache
+    madvise(p, st.st_size, MADV_RANDOM);
+}
+
+static int overlay_compare(const void *aa, const void *bb)
+{
+    const struct overlay_dir *a = *((const struct overlay_dir *const *)aa);
+    const struct overlay_dir *b = *((const struct overlay_dir *const *)bb);
+
+    return strcmp(a->path, b->path);
+}
+
+/* merge the file and the overlay into a new file, called with index_lock held */
+static int write_index(const char *tmp_path)
+{
+    int n_overlay = 0;
+    for (struct overlay_dir * o = overlay; o != NULL; o = o->next)
+        n_overlay++;
+
+    struct overlay_dir **sorted = safe_malloc((n_overlay + 1) * sizeof(struct overlay_dir *));
+    int k = 0;
+    for (struct overlay_dir * o = overlay; o != NULL; o = o->next)
+        sorted[k++] = o;
+    qsort(sorted, n_overlay, sizeof(struct overlay_dir *), overlay_compare);
+
+    uint64_t *offsets = safe_malloc((map_dirs + n_overlay + 1) * sizeof(uint64_t));
+    uint32_t n_dirs = 0;
+    uint64_t off = sizeof(struct index_header);
+
+    FILE *f = fopen(tmp_path, "w");
+    if (!f)
+    {
+        PRINT_LOG(E_ERROR, "Failed to write media index %s: %d\n", tmp_path, errno);
+        free(sorted);
+        free(offsets);
+        return -1;
+    }
+
+    struct index_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    uint32_t i = 0;
+    int j = 0;
+    while (i < map_dirs || j < n_overlay)
+    {
+        const unsigned char *rec;
+        size_t len;
+
+        const char *mp = i < map_dirs ? map_record_path(i) : NULL;
+        if (i < map_dirs && !mp)
+        {
+            i++;
+            continue;
+        }
+
+        int c = !mp ? 1 : j == n_overlay ? -1 : strcmp(mp, sorted[j]->path);
+        if (c < 0)
+        {
+            rec = map_record(i++);
+            len = rec ? record_length(rec, map + map_size) : 0;
+        }
+        else
+        {
+            // a newer listing replaces the stored one
+            if (c == 0)
+                i++;
+            rec = sorted[j]->rec;
+            len = sorted[j++]->len;
+        }
+
+        if (!rec || len == 0)
+            continue;
+
+        offsets[n_dirs++] = off;
+        fwrite(rec, len, 1, f);
+        off += len;
+    }
+
+    static const char zeros[sizeof(uint64_t)];
+    size_t pad = (sizeof(uint64_t) - off % sizeof(uint64_t)) % sizeof(uint64_t);
+    fwrite(zeros, pad, 1, f);
+    off += pad;
+
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.mime_check = get_mime_table_check();
+    hdr.n_dirs = n_dirs;
+    hdr.table_off = off;
+    fwrite(offsets, sizeof(uint64_t), n_dirs, f);
+
+    int r = 0;
+    if (fseek(f, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, f) != 1
+        || fflush(f) != 0 || fsync(fileno(f)) != 0)
+        r = -1;
+    if (fclose(f) != 0)
+        r = -1;
+
+    if (r < 0)
+        PRINT_LOG(E_ERROR, "Failed to write media index %s: %d\n", tmp_path, errno);
+    else
+        PRINT_LOG(E_DEBUG, "Wrote media index: %u directories, %" PRIu64 " bytes\n",
+                  n_dirs, off + n_dirs * sizeof(uint64_t));
+
+    free(sorted);
+    free(offsets);
+    return r;
+}
+
+static void save_index(void)
+{
+    pthread_mutex_lock(&index_lock);
+
+    if (dirty)
+    {
+        size_t len = strlen(index_path);
+        char *tmp_path = safe_malloc(len + sizeof(".tmp"));
+        memcpy(tmp_path, index_path, len);
+        memcpy(tmp_path + len, ".tmp", sizeof(".tmp"));
+
+        // readers keep using the old mapping until the rename is done
+        if (write_index(tmp_path) == 0 && rename(tmp_path, index_path) == 0)
+        {
+            unmap_index();
+            map_index();
+
+            while (overlay)
+            {
+                struct overlay_dir *next = overlay->next;
+                free(overlay->rec);
+                free(overlay);
+                overlay = next;
+            }
+            dirty = 0;
+        }
+        else
+            unlink(tmp_path);
+
+        free(tmp_path);
+    }
+
+    pthread_mutex_unlock(&index_lock);
+}
+
+static void process_save_timer(struct event_handler *ev, int events)
+{
+    save_index();
+}
+
+void init_mediaindex(void)
+{
+    if (!state_dir)
+        return;
+
+    if (mkdir(state_dir, 0755) != 0 && errno != EEXIST)
+    {
+        PRINT_LOG(E_ERROR, "Failed to create state dir %s: %d\n", state_dir, errno);
+        return;
+    }
+
+    size_t len = strlen(state_dir);
+    index_path = safe_malloc(len + sizeof("/" INDEX_FILE));
+    memcpy(index_path, state_dir, len);
+    memcpy(index_path + len, "/" INDEX_FILE, sizeof("/" INDEX_FILE));
+
+    map_index();
+
+    save_timer.process = process_save_timer;
+    if (event_add_timer(&save_timer, INDEX_SAVE_INTERVAL) < 0)
+        EXIT_ERROR("Failed to create the media index timer. EXITING\n");
+
+    PRINT_LOG(E_INFO, "Media index %s: %u directories\n", index_path, map_dirs);
+}
+
+void close_mediaindex(void)
+{
+    if (!index_path)
+        return;
+
+    save_index();
+
+    pthread_mutex_lock(&index_lock);
+    unmap_index();
+    free(index_path);
+    index_path = NULL;
+    pthread_mutex_unlock(&index_lock);
+}
+
+/* worker job, compares an indexed dir with the real one */
+static void recheck_job(void *arg)
+{
+    char *path = arg;
+    struct stat st;
+    int exists = chdir_to_media_dir() == 0 && stat(path, &st) == 0;
+    int changed = 0;
+
+    pthread_mutex_lock(&index_lock);
+
+    const unsigned char *end;
+    const unsigned char *p = index_path ? find_record(path, &end) : NULL;
+    struct index_dir_rec hdr;
+    const char *rec_path;
+    const unsigned char *entries;
+
+    if (p && parse_record(p, end, &hdr, &rec_path, &entries))
+    {
+        changed = !exists || hdr.mtime != st.st_mtime
+            || hdr.ino != st.st_ino || hdr.dev != st.st_dev;
+        if (changed)
+            overlay_put(path, NULL, 0);
+    }
+
+    pthread_mutex_unlock(&index_lock);
+
+    if (changed)
+    {
+        PRINT_LOG(E_DEBUG, "Media index: %s changed, rescanning\n", path);
+        dircache_invalidate(path);
+    }
+
+    free(path);
+}
+
+/* called with index_lock held */
+static void schedule_recheck(const char *path)
+{
+    uint32_t h = 2166136261u;
+    for (const char *p = path; *p; p++)
+        h = (h ^ (uint8_t)*p) * 16777619u;
+
+    time_t now = time(NULL);
+    int slot = h % RECHECK_SLOTS;
+
+    if (rechecks[slot].hash == h && now - rechecks[slot].checked < INDEX_RECHECK_INTERVAL)
+        return;
+
+    rechecks[slot].hash = h;
+    rechecks[slot].checked = now;
+
+    // no hurry, skip it when the workers are busy
+    char *arg = safe_strdup(path);
+    if (queue_work(recheck_job, arg) < 0)
+    {
+        free(arg);
+        rechecks[slot].checked = 0;
+    }
+}
+
+int mediaindex_stat(const char *path, struct stat *st)
+{
+    if (!index_path)
+        return 0;
+
+    int found = 0;
+
+    pthread_mutex_lock(&index_lock);
+
+    const unsigned char *end;
+    const unsigned char *p = find_record(path, &end);
+    struct index_dir_rec hdr;
+    const char *rec_path;
+    const unsigned char *entries;
+
+    if (p && parse_record(p, end, &hdr, &rec_path, &entries))
+    {
+        memset(st, 0, sizeof(*st));
+        st->st_mtime = hdr.mtime;
+        st->st_ino = hdr.ino;
+        st->st_dev = hdr.dev;
+        schedule_recheck(path);
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&index_lock);
+
+    return found;
+}
+
+int mediaindex_load(const char *path, const struct stat *st, directory_listing *dl)
+{
+    if (!index_path)
+        return 0;
+
+    pthread_mutex_lock(&index_lock);
+
+    const unsigned char *end;
+    const unsigned char *p = find_record(path, &end);
+    struct index_dir_rec hdr;
+    const char *rec_path;
+    const unsigned char *q;
+
+    if (!p || !parse_record(p, end, &hdr, &rec_path, &q)
+        || hdr.mtime != st->st_mtime || hdr.ino != st->st_ino || hdr.dev != st->st_dev)
+    {
+        pthread_mutex_unlock(&index_lock);
+        return 0;
+    }
+
+    dl->entries = hdr.n_entries ? safe_malloc(hdr.n_entries * sizeof(content_entry *)) : NULL;
+    dl->length = 0;
+
+    for (uint32_t i = 0; i < hdr.n_entries; i++)
+    {
+        struct index_entry_rec e;
+        const char *name;
+        const struct ext_info *mime = NULL;
+
+        if (!(q = parse_entry(q, end, &e, &name))
+            || (e.mime != INDEX_MIME_DIR && !(mime = get_mime_by_index(e.mime))))
+        {
+            PRINT_LOG(E_ERROR, "Media index: corrupt listing of %s\n", path);
+            free_directory_listing(dl);
+            pthread_mutex_unlock(&index_lock);
+            return 0;
+        }
+
+        content_entry *ce = safe_malloc(sizeof(content_entry) + e.name_len);
+        ce->type = mime ? T_FILE : T_DIR;
+        ce->size = e.size;
+        ce->mime = mime;
+        memcpy(ce->name, name, e.name_len);
+        dl->entries[dl->length++] = ce;
+    }
+
+    pthread_mutex_unlock(&index_lock);
+
+    return 1;
+}
+
+void mediaindex_store(const char *path, const struct stat *st, const directory_listing *dl)
+{
+    if (!index_path || time(NULL) - st->st_mtime < INDEX_SETTLE_TIME)
+        return;
+
+    struct index_dir_rec hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.mtime = st->st_mtime;
+    hdr.ino = st->st_ino;
+    hdr.dev = st->st_dev;
+    hdr.n_entries = dl->length;
+    hdr.path_len = strlen(path) + 1;
+
+    size_t len = sizeof(hdr) + hdr.path_len;
+    for (int i = 0; i < dl->length; i++)
+        len += sizeof(struct index_entry_rec) + strlen(dl->entries[i]->name) + 1;
+
+    unsigned char *rec = safe_malloc(len);
+    unsigned char *w = rec;
+
+    memcpy(w, &hdr, sizeof(hdr));
+    w += sizeof(hdr);
+    memcpy(w, path, hdr.path_len);
+    w += hdr.path_len;
+
+    for (int i = 0; i < dl->length; i++)
+    {
+        const content_entry *ce = dl->entries[i];
+        struct index_entry_rec e;
+
+        memset(&e, 0, sizeof(e));
+        e.size = ce->size;
+        e.mime = ce->type == T_DIR ? INDEX_MIME_DIR : get_mime_index(ce->mime);
+        e.name_len = strlen(ce->name) + 1;
+
+        memcpy(w, &e, sizeof(e));
+        w += sizeof(e);
+        memcpy(w, ce->name, e.name_len);
+        w += e.name_len;
+    }
+
+    pthread_mutex_lock(&index_lock);
+    overlay_put(path, rec, len);
+    pthread_mutex_unlock(&index_lock);
+}
+
+void mediaindex_invalidate(const char *path)
+{
+    if (!index_path)
+        return;
+
+    pthread_mutex_lock(&index_lock);
+    const unsigned char *end;
+    if (find_record(path, &end))
+        overlay_put(path, NULL, 0);
+    pthread_mutex_unlock(&index_lock);
+}
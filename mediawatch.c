@@ -0,0 +1,459 @@
+/* Media directory watcher
+ *
+ * Copyright (C) 2025, Michael J. Walsh
+ *
+ * This file is part of MicroDLNA.
+ *
+ * MicroDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MicroDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MicroDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mediawatch.h"
+#include "stream.h"
+#include "log.h"
+#include "globalvars.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "dircache.h"
+#include "event.h"
+#include "filecache.h"
+#include "mediadir.h"
+#include "mediaindex.h"
+#include "upnpevents.h"
+#include "utils.h"
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_CLOSE_WRITE | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/* ContentDirectory moderates its evented variables to one event per 2s */
+#define MODERATION_INTERVAL 2
+
+/* longest ContainerUpdateIDs value sent, later changes are only
+ * reflected by SystemUpdateID */
+#define CONTAINER_UPDATE_IDS_MAX 2048
+
+struct watched_dir
+{
+    int wd;
+    int changed;
+    unsigned int update_id;
+    char *path;                 /* relative to media_dir, "" for the root */
+};
+
+/* the index is read by the http workers while browsing */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct watched_dir *dirs = NULL;
+static int n_dirs = 0;
+static int max_dirs = 0;
+
+static unsigned int system_update_id = 0;
+static char *container_update_ids = NULL;
+
+static struct event_handler inotify_ev = { .fd = -1 };
+static struct event_handler moderation_timer = { .fd = -1 };
+static int moderation_armed = 0;
+
+static struct watched_dir *find_wd(int wd)
+{
+    for (int i = 0; i < n_dirs; i++)
+        if (dirs[i].wd == wd)
+            return &dirs[i];
+    return NULL;
+}
+
+static struct watched_dir *find_path(const char *path)
+{
+    for (int i = 0; i < n_dirs; i++)
+        if (strcmp(dirs[i].path, path) == 0)
+            return &dirs[i];
+    return NULL;
+}
+
+static void join_path(char *buf, const char *dir, const char *name)
+{
+    if (dir[0] == '\0')
+        snprintf(buf, PATH_MAX, "%s", name);
+    else
+        snprintf(buf, PATH_MAX, "%s/%s", dir, name);
+}
+
+/* watch path and every directory below it */
+static void add_watch(const char *path)
+{
+    int wd = inotify_add_watch(inotify_ev.fd, path[0] ? path : ".", WATCH_MASK);
+    if (wd < 0)
+    {
+        // running out of watches leaves part of the tree unwatched
+        if (errno == ENOSPC)
+            PRINT_LOG(E_ERROR, "inotify_add_watch(%s): out of watches\n", path);
+        else
+            PRINT_LOG(E_DEBUG, "inotify_add_watch(%s): %d\n", path, errno);
+        return;
+    }
+
+    pthread_mutex_lock(&watch_lock);
+
+    // the same directory may be reported twice while it is being scanned
+    struct watched_dir *d = find_wd(wd);
+    if (d)
+    {
+        free(d->path);
+        d->path = safe_strdup(path);
+    }
+    else
+    {
+        if (n_dirs == max_dirs)
+        {
+            max_dirs = max_dirs ? max_dirs * 2 : 64;
+            safe_realloc((void **)&dirs, max_dirs * sizeof(struct watched_dir));
+        }
+        d = &dirs[n_dirs++];
+        d->wd = wd;
+        d->changed = 0;
+        d->update_id = system_update_id;
+        d->path = safe_strdup(path);
+    }
+
+    pthread_mutex_unlock(&watch_lock);
+
+    DIR *dir = opendir(path[0] ? path : ".");
+    if (!dir)
+        return;
+
+    struct dirent *de;
+    char child[PATH_MAX];
+
+    while ((de = readdir(dir)) != NULL)
+    {
+        // hidden the same way as in the directory listings, symlinks may loop
+        if (de->d_name[0] == '.' || de->d_name[0] == '$')
+            continue;
+
+        join_path(child, path, de->d_name);
+
+        int is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            is_dir = lstat(child, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+
+        if (is_dir)
+            add_watch(child);
+    }
+
+    closedir(dir);
+}
+
+/* forget path and everything below it */
+static void remove_watch(const char *path)
+{
+    size_t len = strlen(path);
+
+    pthread_mutex_lock(&watch_lock);
+
+    for (int i = 0; i < n_dirs;)
+    {
+        if (strncmp(dirs[i].path, path, len) == 0
+            && (dirs[i].path[len] == '\0' || dirs[i].path[len] == '/'))
+        {
+            inotify_rm_watch(inotify_ev.fd, dirs[i].wd);
+            free(dirs[i].path);
+            dirs[i] = dirs[--n_dirs];
+        }
+        else
+            i++;
+    }
+
+    pthread_mutex_unlock(&watch_lock);
+}
+
+/* called with watch_lock held */
+static void mark_changed(struct watched_dir *d)
+{
+    d->update_id = ++system_update_id;
+    d->changed = 1;
+    dircache_invalidate(d->path[0] ? d->path : ".");
+    filecache_invalidate_dir(d->path[0] ? d->path : ".");
+    mediaindex_invalidate(d->path[0] ? d->path : ".");
+
+    if (!moderation_armed && event_add_timer(&moderation_timer, MODERATION_INTERVAL) == 0)
+        moderation_armed = 1;
+}
+
+static void append(char **buf, size_t *len, size_t *size, const char *s, size_t n)
+{
+    if (*len + n + 1 > *size)
+    {
+        *size = (*len + n + 1) * 2;
+        safe_realloc((void **)buf, *size);
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+/* object ids are csv escaped for the list and xml escaped for the event */
+static void append_id(char **buf, size_t *len, size_t *size, const char *id)
+{
+    for (; *id; id++)
+    {
+        switch (*id)
+        {
+        case ',':
+            append(buf, len, size, "\\,", 2);
+            break;
+        case '\\':
+            append(buf, len, size, "\\\\", 2);
+            break;
+        case '&':
+            append(buf, len, size, "&amp;", 5);
+            break;
+        case '<':
+            append(buf, len, size, "&lt;", 4);
+            break;
+        case '>':
+            append(buf, len, size, "&gt;", 4);
+            break;
+        default:
+            append(buf, len, size, id, 1);
+        }
+    }
+}
+
+/* timer handler, sends the changes collected since the last event */
+static void process_moderation_timer(struct event_handler *ev, int events)
+{
+    event_del_timer(ev);
+    moderation_armed = 0;
+
+    char *ids = NULL;
+    size_t len = 0, size = 0;
+    char num[16];
+
+    append(&ids, &len, &size, "", 0);
+
+    pthread_mutex_lock(&watch_lock);
+
+    for (int i = 0; i < n_dirs; i++)
+    {
+        if (!dirs[i].changed)
+            continue;
+        dirs[i].changed = 0;
+
+        if (len > CONTAINER_UPDATE_IDS_MAX)
+            continue;
+
+        if (len)
+            append(&ids, &len, &size, ",", 1);
+
+        // same ids as handed out by Browse: "0" for the root and a
+        // leading slash for its direct children
+        if (dirs[i].path[0] == '\0')
+            append(&ids, &len, &size, "0", 1);
+        else
+        {
+            if (!strchr(dirs[i].path, '/'))
+                append(&ids, &len, &size, "/", 1);
+            append_id(&ids, &len, &size, dirs[i].path);
+        }
+
+        int n = snprintf(num, sizeof(num), ",%u", dirs[i].update_id);
+        append(&ids, &len, &size, num, n);
+    }
+
+    free(container_update_ids);
+    container_update_ids = ids;
+
+    PRINT_LOG(E_DEBUG, "SystemUpdateID %u, ContainerUpdateIDs '%s'\n",
+              system_update_id, container_update_ids);
+
+    pthread_mutex_unlock(&watch_lock);
+
+    upnpevents_content_directory_changed();
+}
+
+static void process_inotify_event(const struct inotify_event *ie)
+{
+    if (ie->mask & IN_Q_OVERFLOW)
+    {
+        // events were lost, treat every directory as changed
+        PRINT_LOG(E_INFO, "inotify queue overflow, rescanning everything\n");
+        pthread_mutex_lock(&watch_lock);
+        for (int i = 0; i < n_dirs; i++)
+            mark_changed(&dirs[i]);
+        pthread_mutex_unlock(&watch_lock);
+        return;
+    }
+
+    pthread_mutex_lock(&watch_lock);
+
+    struct watched_dir *d = find_wd(ie->wd);
+    if (!d)
+    {
+        pthread_mutex_unlock(&watch_lock);
+        return;
+    }
+
+    if (ie->mask & IN_IGNORED)
+    {
+        // the kernel dropped the watch, the directory is gone
+        free(d->path);
+        *d = dirs[--n_dirs];
+        pthread_mutex_unlock(&watch_lock);
+        return;
+    }
+
+    if (ie->len == 0 || ie->name[0] == '.' || ie->name[0] == '$')
+    {
+        pthread_mutex_unlock(&watch_lock);
+        return;
+    }
+
+    char child[PATH_MAX];
+    join_path(child, d->path, ie->name);
+
+    PRINT_LOG(E_DEBUG, "inotify: %s changed (0x%x)\n", child, ie->mask);
+
+    mark_changed(d);
+
+    pthread_mutex_unlock(&watch_lock);
+
+    if (ie->mask & IN_ISDIR)
+    {
+        if (ie->mask & (IN_DELETE | IN_MOVED_FROM))
+            remove_watch(child);
+        else if (ie->mask & (IN_CREATE | IN_MOVED_TO))
+            add_watch(child);
+    }
+}
+
+/* inotify fd is readable, drain it */
+static void process_inotify(struct event_handler *ev, int events)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;)
+    {
+        ssize_t n = read(ev->fd, buf, sizeof(buf));
+        if (n <= 0)
+        {
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                PRINT_LOG(E_ERROR, "read(inotify): %d\n", errno);
+            if (n < 0 && errno == EINTR)
+                continue;
+            return;
+        }
+
+        for (char *p = buf; p < buf + n;)
+        {
+            const struct inotify_event *ie = (const struct inotify_event *)p;
+            process_inotify_event(ie);
+            p += sizeof(struct inotify_event) + ie->len;
+        }
+    }
+}
+
+void init_mediawatch(void)
+{
+    if (!watch_media)
+        return;
+
+    inotify_ev.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_ev.fd < 0)
+    {
+        PRINT_LOG(E_ERROR, "inotify_init1(): %d\n", errno);
+        return;
+    }
+
+    if (chdir_to_media_dir() != 0)
+    {
+        PRINT_LOG(E_ERROR, "Failed to watch media dir %s: %d\n", media_dir, errno);
+        close(inotify_ev.fd);
+        inotify_ev.fd = -1;
+        return;
+    }
+
+    add_watch("");
+
+    inotify_ev.process = process_inotify;
+    moderation_timer.process = process_moderation_timer;
+
+    if (event_add(&inotify_ev, EVENT_READ) < 0)
+        EXIT_ERROR("Failed to watch the media dir. EXITING\n");
+
+    PRINT_LOG(E_INFO, "Watching %d directories of %s\n", n_dirs, media_dir);
+}
+
+unsigned int mediawatch_system_update_id(void)
+{
+    pthread_mutex_lock(&watch_lock);
+    unsigned int id = system_update_id;
+    pthread_mutex_unlock(&watch_lock);
+
+    return id;
+}
+
+unsigned int mediawatch_container_update_id(const char *path)
+{
+    pthread_mutex_lock(&watch_lock);
+    const struct watched_dir *d = find_path(path);
+    unsigned int id = d ? d->update_id : system_update_id;
+    pthread_mutex_unlock(&watch_lock);
+
+    return id;
+}
+
+void mediawatch_print_container_update_ids(struct stream *st)
+{
+    pthread_mutex_lock(&watch_lock);
+    if (container_update_ids)
+        chunk_print(st, container_update_ids);
+    pthread_mutex_unlock(&watch_lock);
+}
+
+#else
+
+void init_mediawatch(void)
+{
+    if (watch_media)
+        PRINT_LOG(E_ERROR, "Watching the media dir needs inotify, ignored\n");
+}
+
+unsigned int mediawatch_system_update_id(void)
+{
+    return 0;
+}
+
+unsigned int mediawatch_container_update_id(const char *path)
+{
+    return 0;
+}
+
+void mediawatch_print_container_update_ids(struct stream *st)
+{
+}
+
+#endif
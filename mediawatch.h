@@ -0,0 +1,32 @@
+#pragma once
+/* Media directory watcher
+ *
+ * Copyright (C) 2025, Michael J. Walsh
+ *
+ * This file is part of MicroDLNA.
+ *
+ * MicroDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MicroDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MicroDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+struct stream;
+
+/* start watching media_dir when enabled, must run on the main loop */
+void init_mediawatch(void);
+
+unsigned int mediawatch_system_update_id(void);
+
+/* update id of a container, path is relative to media_dir, "" for the root */
+unsigned int mediawatch_container_update_id(const char *path);
+
+/* ContainerUpdateIDs of the last event: "id,update_id,..." */
+void mediawatch_print_container_update_ids(struct stream *st);
@@ -62,18 +62,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/param.h>
-#include <sys/select.h>
 #include <sys/socket.h>
-#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "event.h"
 #include "globalvars.h"
 #include "getifaddr.h"
+#include "iouring.h"
 #include "log.h"
+#include "mediaindex.h"
+#include "mediawatch.h"
 #include "minissdp.h"
+#include "search.h"
 #include "threads.h"
 #include "upnpdescgen.h"
 #include "upnpevents.h"
@@ -85,9 +87,19 @@
 int listening_port = 2800;      /* HTTP Port */
 int notify_interval = 895;      /* seconds between SSDP announces */
 int max_connections = 10;       /* max number of simultaneous conenctions */
+int queue_depth = 16;           /* connections waiting for a free worker */
+int max_chunk_size = 16;        /* KiB, largest HTTP chunk sent */
+int content_length_responses = 0;       /* send small bodies with a Content-Length */
+int max_client_rate = 0;        /* KiB/s per file transfer, 0 for no limit */
+int max_total_rate = 0;         /* KiB/s shared by all file transfers */
+int use_io_uring = 0;           /* move file transfers to the io_uring engine */
 int mode_systemd = 0;           /* systemd-compatible mode or not */
 
 char *media_dir = NULL;
+int dir_cache_size = 1024;      /* KiB of directory listings kept in memory */
+int watch_media = 0;            /* follow media_dir changes with inotify */
+char *state_dir = NULL;         /* where the media index is kept */
+int enable_search = 0;          /* answer Search from a name index */
 
 #define FRIENDLYNAME_MAX_LEN 64
 char friendly_name[FRIENDLYNAME_MAX_LEN] = { '\0' };
@@ -116,6 +128,10 @@ static struct option long_options[] = {
 
     // media settings
     { "media-dir", required_argument, NULL, 'D' },
+    { "dir-cache-size", required_argument, NULL, 'C' },
+    { "watch-media", required_argument, NULL, 'w' },
+    { "state-dir", required_argument, NULL, 's' },
+    { "search", required_argument, NULL, 'e' },
 
     // running environment
     { "user", required_argument, NULL, 'u' },
@@ -127,6 +143,12 @@ static struct option long_options[] = {
     { "port", required_argument, NULL, 'p' },
     { "network-interface", required_argument, NULL, 'i' },
     { "max-connections", required_argument, NULL, 'c' },
+    { "queue-depth", required_argument, NULL, 'q' },
+    { "chunk-size", required_argument, NULL, 'k' },
+    { "content-length", required_argument, NULL, 'n' },
+    { "max-client-rate", required_argument, NULL, 'r' },
+    { "max-total-rate", required_argument, NULL, 'R' },
+    { "io-uring", required_argument, NULL, 'I' },
 
     // UPnP settings
     { "notify-interval", required_argument, NULL, 't' },
@@ -214,6 +236,17 @@ static void help(const char *arg0)
     printf("Media settings:\n");
     printf("    -D, --media-dir <path>\n");
     printf("        Media dir to publish, MANDATORY\n");
+    printf("    -C, --dir-cache-size <KiB>\n");
+    printf("        Memory for cached directory listings, 0 disables, now: %d\n",
+           dir_cache_size);
+    printf("    -w, --watch-media <yes|no>\n");
+    printf("        Notify clients when media files change, now: %s\n",
+           watch_media ? "yes" : "no");
+    printf("    -s, --state-dir <path>\n");
+    printf("        Keep an index of the media dir there, default: none\n");
+    printf("    -e, --search <yes|no>\n");
+    printf("        Support Search with an in-memory name index, now: %s\n",
+           enable_search ? "yes" : "no");
 
     printf("Running environment:\n");
     printf("    -u, --user <uid or username>\n");
@@ -248,6 +281,22 @@ static void help(const char *arg0)
     printf("    -c, --max-connections <n>\n");
     printf("        Maximal number of concurrent connections, now: %d\n",
            max_connections);
+    printf("    -q, --queue-depth <n>\n");
+    printf("        Connections waiting for a free worker, now: %d\n", queue_depth);
+    printf("    -k, --chunk-size <KiB>\n");
+    printf("        Largest chunk of a response, 1 to 64, now: %d\n", max_chunk_size);
+    printf("    -n, --content-length <yes|no>\n");
+    printf("        Send responses with a Content-Length instead of chunks, now: %s\n",
+           content_length_responses ? "yes" : "no");
+    printf("    -r, --max-client-rate <KiB/s>\n");
+    printf("        Bandwidth cap of each file transfer, 0 for none, now: %d\n",
+           max_client_rate);
+    printf("    -R, --max-total-rate <KiB/s>\n");
+    printf("        Bandwidth shared evenly by all file transfers, 0 for none, now: %d\n",
+           max_total_rate);
+    printf("    -I, --io-uring <yes|no>\n");
+    printf("        Send files from a single io_uring thread, now: %s\n",
+           use_io_uring ? "yes" : "no");
 
     printf("UPnP settings:\n");
     printf("    -t, --notify-interval <n>\n");
@@ -258,6 +307,16 @@ static void help(const char *arg0)
     printf("        Friendly name, now: %s\n", friendly_name);
 }
 
+static int parse_yes_no(const char *arg_value, const char *arg_name)
+{
+    if (strcasecmp(arg_value, "yes") == 0)
+        return 1;
+    if (strcasecmp(arg_value, "no") == 0)
+        return 0;
+
+    EXIT_ERROR("Invalid value '%s' for %s, use yes or no.\n", arg_value, arg_name);
+}
+
 // this function can receive args from the command line and the
 // config file
 static void process_option(int c, const char *arg_value, const char *arg_name,
@@ -300,6 +359,27 @@ static void process_option(int c, const char *arg_value, const char *arg_name,
         media_dir = safe_strdup(arg_value);
         break;
 
+    case 'C':                  // --dir_cache_size
+        dir_cache_size = atoi(arg_value);
+        if (dir_cache_size < 0)
+            EXIT_ERROR("Invalid dir cache size '%s'.\n", arg_value);
+        break;
+
+    case 'w':                  // --watch_media
+        watch_media = parse_yes_no(arg_value, arg_name);
+        break;
+
+    case 's':                  // --state_dir
+        if (state_dir != NULL)
+            free(state_dir);
+
+        state_dir = safe_strdup(arg_value);
+        break;
+
+    case 'e':                  // --search
+        enable_search = parse_yes_no(arg_value, arg_name);
+        break;
+
     case 'L':                  // --log_file
         log_fd = open(arg_value, O_WRONLY | O_APPEND | O_CREAT, 0666);
         if (log_fd < 0)
@@ -331,6 +411,38 @@ static void process_option(int c, const char *arg_value, const char *arg_name,
             EXIT_ERROR("Invalid max connections '%s'.\n", arg_value);
         break;
 
+    case 'q':                  // --queue_depth
+        queue_depth = atoi(arg_value);
+        if (queue_depth < 1)
+            EXIT_ERROR("Invalid queue depth '%s'.\n", arg_value);
+        break;
+
+    case 'k':                  // --chunk_size
+        max_chunk_size = atoi(arg_value);
+        if (max_chunk_size < 1 || max_chunk_size > 64)
+            EXIT_ERROR("Invalid chunk size '%s', use 1 to 64.\n", arg_value);
+        break;
+
+    case 'n':                  // --content_length
+        content_length_responses = parse_yes_no(arg_value, arg_name);
+        break;
+
+    case 'r':                  // --max_client_rate
+        max_client_rate = atoi(arg_value);
+        if (max_client_rate < 0)
+            EXIT_ERROR("Invalid client rate '%s'.\n", arg_value);
+        break;
+
+    case 'R':                  // --max_total_rate
+        max_total_rate = atoi(arg_value);
+        if (max_total_rate < 0)
+            EXIT_ERROR("Invalid total rate '%s'.\n", arg_value);
+        break;
+
+    case 'I':                  // --io_uring
+        use_io_uring = parse_yes_no(arg_value, arg_name);
+        break;
+
     case 'P':                  // --pid_file
         if (pidfilename != NULL)
             free(pidfilename);
@@ -499,7 +611,7 @@ static void init(int argc, char *const *argv)
     int c;
 
     while ((c =
-                getopt_long(argc, argv, ":hVdvSgf:D:u:L:l:P:p:i:c:t:U:F:",
+                getopt_long(argc, argv, ":hVdvSgf:D:C:w:s:e:u:L:l:P:p:i:c:q:k:n:r:R:I:t:U:F:",
                             long_options, NULL)) != -1)
     {
         process_option(c, optarg, argv[optind - 1], argv[0]);
@@ -594,8 +706,10 @@ static void init(int argc, char *const *argv)
             EXIT_ERROR("setsid failed: %d\n", errno);
     }
 
-    // init threads
+    // init threads and the event loop
     init_threads();
+    init_event();
+    init_upnpevents();
 
     // signals
     set_signal_handlers();
@@ -612,133 +726,112 @@ static void init(int argc, char *const *argv)
     }
 }
 
-int main(int argc, char *const *argv)
+/* SSDP socket is readable, answer every queued M-SEARCH */
+static void process_ssdp(struct event_handler *ev, int events)
 {
-    // initialise the system
-    init(argc, argv);
-
-    reload_ifaces(0, sssdp);
-
-    struct timeval timeout, timeofday, lastnotifytime = { 0, 0 };
-    lastnotifytime.tv_sec = time(NULL) + notify_interval;
+    while (!quitting && process_ssdp_request(ev->fd) == 0)
+        ;
+}
 
-    /* main loop */
+/* HTTP listen socket is readable, accept until the backlog is empty */
+static void process_http_accept(struct event_handler *ev, int events)
+{
     while (!quitting)
     {
-        /* Check if we need to send SSDP NOTIFY messages and do it if
-         * needed */
-        if (gettimeofday(&timeofday, 0) < 0)
-        {
-            PRINT_LOG(E_ERROR, "gettimeofday(): %d\n", errno);
-            timeout.tv_sec = notify_interval;
-            timeout.tv_usec = 0;
-        }
-        /* the comparison is not very precise but who cares ? */
-        else if (timeofday.tv_sec >= (lastnotifytime.tv_sec + notify_interval))
+        struct sockaddr_in clientname;
+        socklen_t clientnamelen = sizeof(struct sockaddr_in);
+        int shttp = accept(ev->fd, (struct sockaddr *)&clientname, &clientnamelen);
+
+        if (shttp < 0)
         {
-            PRINT_LOG(E_DEBUG, "Sending SSDP notifies\n");
-            send_all_ssdp_notifies();
-            memcpy(&lastnotifytime, &timeofday, sizeof(struct timeval));
-            timeout.tv_sec = notify_interval;
-            timeout.tv_usec = 0;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                PRINT_LOG(E_ERROR, "accept(http): %d\n", errno);
+            if (errno != EINTR)
+                return;
+            continue;
         }
-        else
+
+        // reject connections from unknown interfaces
+        int iface = -1;
+
+        if (clientname.sin_addr.s_addr != INADDR_LOOPBACK)
         {
-            timeout.tv_sec = lastnotifytime.tv_sec + notify_interval - timeofday.tv_sec;
-            if (timeofday.tv_usec > lastnotifytime.tv_usec)
+            iface = get_interface(&clientname.sin_addr);
+            if (iface == -1)
             {
-                timeout.tv_usec = 1000000 + lastnotifytime.tv_usec - timeofday.tv_usec;
-                timeout.tv_sec--;
+                close(shttp);
+                PRINT_LOG(E_DEBUG, "Rejected HTTP connection from %s:%d\n",
+                          inet_ntoa_ts(clientname.sin_addr),
+                          ntohs(clientname.sin_port));
+                continue;
             }
-            else
-                timeout.tv_usec = lastnotifytime.tv_usec - timeofday.tv_usec;
         }
 
-        /* select open sockets (SSDP, HTTP listen, and all HTTP soap sockets) */
-        fd_set readset;
-        FD_ZERO(&readset);
+        PRINT_LOG(E_DEBUG, "Accepted HTTP connection from %s:%d\n",
+                  inet_ntoa_ts(clientname.sin_addr), ntohs(clientname.sin_port));
 
-        int max_fd = -1;
-        if (sssdp >= 0)
-        {
-            FD_SET(sssdp, &readset);
-            max_fd = MAX(max_fd, sssdp);
-        }
+#ifndef __linux__
+        // BSD lets accepted sockets inherit O_NONBLOCK, workers expect blocking io
+        set_non_blocking(shttp, 0);
+#endif
 
-        if (shttpl >= 0)
+        // hand the connection over to a worker thread
+        if (!dispatch_upnphttp_connection(shttp, iface))
         {
-            FD_SET(shttpl, &readset);
-            max_fd = MAX(max_fd, shttpl);
+            PRINT_LOG(E_ERROR, "dispatch_upnphttp_connection() failed\n");
+            close(shttp);
         }
+    }
+}
 
-        fd_set writeset;
-        FD_ZERO(&writeset);
-        upnpevents_selectfds(&readset, &writeset, &max_fd);
+static void process_notify_timer(struct event_handler *ev, int events)
+{
+    PRINT_LOG(E_DEBUG, "Sending SSDP notifies\n");
+    send_all_ssdp_notifies();
+}
 
-        int ret = select(max_fd + 1, &readset, &writeset, 0, &timeout);
-        if (ret < 0)
-        {
-            if (quitting)
-                goto shutdown;
-            if (errno == EINTR)
-                continue;
-            PRINT_LOG(E_ERROR, "select(all): %d\n", errno);
-            EXIT_ERROR("Failed to select open sockets. EXITING\n");
-        }
-        upnpevents_processfds(&readset, &writeset);
-        upnpevents_removed_timedout_subs();
+int main(int argc, char *const *argv)
+{
+    // initialise the system
+    init(argc, argv);
 
-        /* process SSDP packets */
-        if (sssdp >= 0 && FD_ISSET(sssdp, &readset))
-            process_ssdp_request(sssdp);
+    reload_ifaces(0, sssdp);
 
-        /* process incoming HTTP connections */
-        if (shttpl >= 0 && FD_ISSET(shttpl, &readset))
-        {
-            struct sockaddr_in clientname;
-            socklen_t clientnamelen = sizeof(struct sockaddr_in);
-            int shttp = accept(shttpl, (struct sockaddr *)&clientname, &clientnamelen);
+    struct event_handler ssdp_ev = { .fd = sssdp, .process = process_ssdp };
+    struct event_handler http_ev = { .fd = shttpl, .process = process_http_accept };
+    struct event_handler notify_timer = { .process = process_notify_timer };
 
-            if (shttp < 0)
-            {
-                PRINT_LOG(E_ERROR, "accept(http): %d\n", errno);
-                continue;
-            }
+    if (set_non_blocking(sssdp, 1) < 0 || event_add(&ssdp_ev, EVENT_READ) < 0)
+        EXIT_ERROR("Failed to watch the SSDP socket. EXITING\n");
 
-            // reject connections from unknown interfaces
-            int iface = -1;
+    if (set_non_blocking(shttpl, 1) < 0 || event_add(&http_ev, EVENT_READ) < 0)
+        EXIT_ERROR("Failed to watch the HTTP socket. EXITING\n");
 
-            if (clientname.sin_addr.s_addr != INADDR_LOOPBACK)
-            {
-                iface = get_interface(&clientname.sin_addr);
-                if (iface == -1)
-                {
-                    close(shttp);
-                    PRINT_LOG(E_DEBUG, "Rejected HTTP connection from %s:%d\n",
-                              inet_ntoa_ts(clientname.sin_addr),
-                              ntohs(clientname.sin_port));
-                    continue;
-                }
-            }
+    if (event_add_timer(&notify_timer, notify_interval) < 0)
+        EXIT_ERROR("Failed to create the SSDP notify timer. EXITING\n");
 
-            PRINT_LOG(E_DEBUG, "Accepted HTTP connection from %s:%d\n",
-                      inet_ntoa_ts(clientname.sin_addr), ntohs(clientname.sin_port));
+    init_mediaindex();
+    init_mediawatch();
+    init_search();
+    init_iouring();
 
-            // process a http connection
-            if (!process_upnphttp_http_query(shttp, iface))
-            {
-                PRINT_LOG(E_ERROR, "process_upnphttp_http_query() failed\n");
-                close(shttp);
-            }
+    /* main loop */
+    while (!quitting)
+    {
+        if (event_dispatch() < 0)
+        {
+            if (quitting)
+                break;
+            EXIT_ERROR("Failed to wait for events. EXITING\n");
         }
     }
 
-shutdown:
 
     send_all_ssdp_goodbyes();
     clear_upnpevent_subscribers();
     upnpevents_clear_notify_list();
     free_ifaces();
+    close_mediaindex();
 
     if (sssdp >= 0)
         close(sssdp);
@@ -749,6 +842,7 @@ shutdown:
         PRINT_LOG(E_ERROR, "Failed to remove pidfile %s: %d\n", pidfilename, errno);
 
     free(media_dir);
+    free(state_dir);
     free(pidfilename);
 
     PRINT_LOG(E_INFO, "exiting program\n");
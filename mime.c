@@ -27,6 +27,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -278,3 +279,27 @@ struct ext_info *get_mime_type(const char *filename)
 
     return NULL;
 }
+
+int get_mime_index(const struct ext_info *mime)
+{
+    return mime - types;
+}
+
+const struct ext_info *get_mime_by_index(int index)
+{
+    if (index < 0 || index >= item_count)
+        return NULL;
+    return &types[index];
+}
+
+/* fingerprint of the table, stored indices are only valid for the same table */
+uint32_t get_mime_table_check(void)
+{
+    uint32_t h = 2166136261u;
+
+    for (int i = 0; i < item_count; i++)
+        for (const char *p = types[i].ext; *p; p++)
+            h = (h ^ (uint8_t)*p) * 16777619u;
+
+    return h ^ item_count;
+}
@@ -28,6 +28,8 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdint.h>
+
 enum MimeType
 {
     M_VIDEO,
@@ -46,3 +48,10 @@ struct ext_info
 const char *mime_type_to_text(enum MimeType main_type);
 
 struct ext_info *get_mime_type(const char *filename);
+
+/* position in the mime table, for storing a type in the media index */
+int get_mime_index(const struct ext_info *mime);
+
+const struct ext_info *get_mime_by_index(int index);
+
+uint32_t get_mime_table_check(void);
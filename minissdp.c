@@ -305,8 +305,9 @@ void send_ssdp_notifies(int s, const char *host)
 }
 
 /* ProcessSSDPRequest()
- * process SSDP M-SEARCH requests and responds to them */
-void process_ssdp_request(int sssdp)
+ * process SSDP M-SEARCH requests and responds to them
+ * returns -1 once there is nothing left to read on the socket */
+int process_ssdp_request(int sssdp)
 {
     char bufr[200];
     struct sockaddr_in sendername;
@@ -338,20 +339,21 @@ void process_ssdp_request(int sssdp)
 
     if (n < 0)
     {
-        PRINT_LOG(E_ERROR, "recvfrom(udp): %d\n", errno);
-        return;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            PRINT_LOG(E_ERROR, "recvfrom(udp): %d\n", errno);
+        return -1;
     }
     if (n >= sizeof(bufr))
     {
         PRINT_LOG(E_ERROR, "recvfrom(udp): exceeded buffer\n");
-        return;
+        return 0;
     }
 
     bufr[n] = '\0';
 
     char *p = bufr;
     if (strncmp(p, "M-SEARCH * HTTP/1.1\r\n", 21) != 0)
-        return;
+        return 0;
     p += 21;
 
     for (;;)
@@ -413,20 +415,20 @@ void process_ssdp_request(int sssdp)
         PRINT_LOG(E_DEBUG,
                   "WARNING: Ignoring invalid SSDP M-SEARCH from %s [bad MAN header '%s']\n",
                   inet_ntoa_ts(sendername.sin_addr), man);
-        return;
+        return 0;
     }
     else if (!mx || mx_val < 0)
     {
         PRINT_LOG(E_DEBUG,
                   "WARNING: Ignoring invalid SSDP M-SEARCH from %s [bad MX header '%s']\n",
                   inet_ntoa_ts(sendername.sin_addr), mx);
-        return;
+        return 0;
     }
     else if (!st)
     {
         PRINT_LOG(E_DEBUG, "Invalid SSDP M-SEARCH from %s:%d\n",
                   inet_ntoa_ts(sendername.sin_addr), ntohs(sendername.sin_port));
-        return;
+        return 0;
     }
 
 #ifdef __linux__
@@ -452,7 +454,7 @@ void process_ssdp_request(int sssdp)
         PRINT_LOG(E_DEBUG,
                   "Ignoring SSDP M-SEARCH on other interface [%s]\n",
                   inet_ntoa_ts(sendername.sin_addr));
-        return;
+        return 0;
     }
 
     const char *host = get_interface_ip_str(iface);
@@ -497,7 +499,7 @@ void process_ssdp_request(int sssdp)
         }
         microsleep(random() >> 20);
         send_ssdp_response(sssdp, sendername, i, host);
-        return;
+        return 0;
     }
     /* Responds to request with ST: ssdp:all */
     if (strcmp(st, "ssdp:all") == 0)
@@ -507,6 +509,7 @@ void process_ssdp_request(int sssdp)
             send_ssdp_response(sssdp, sendername, i, host);
         }
     }
+    return 0;
 }
 
 /* This will broadcast ssdp:byebye notifications to inform
@@ -40,6 +40,6 @@ int open_ssdp_notify_socket(struct lan_addr_s *iface, int sssdp);
 
 void send_ssdp_notifies(int s, const char *host);
 
-void process_ssdp_request(int s);
+int process_ssdp_request(int s);
 
 int send_ssdp_goodbyes(int s);
@@ -0,0 +1,834 @@
+/*
+ *
+ * This file is part of MicroDLNA:
+ * Copyright (c) 2025, Michael Walsh
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The name of the author may not be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "search.h"
+#include "globalvars.h"
+#include "log.h"
+#include "mediadir.h"
+#include "mediawatch.h"
+#include "mime.h"
+#include "utils.h"
+
+/* without change notifications the index is rebuilt on the first
+ * search after this many seconds */
+#define SEARCH_INDEX_MAX_AGE 3600
+
+#define NO_PARENT UINT32_MAX
+#define MIME_DIR UINT16_MAX
+
+/* The media tree flattened so that the children of a folder are
+ * consecutive and followed by their own descendants: every folder's
+ * subtree is the range [children, subtree_end). */
+struct indexed_entry
+{
+    uint64_t size;
+    uint32_t parent;
+    uint32_t name;              /* offset in names */
+    uint32_t children;
+    uint32_t n_children;
+    uint32_t subtree_end;
+    uint16_t mime;              /* MIME_DIR for folders */
+};
+
+struct search_index
+{
+    struct indexed_entry *entries;
+    uint32_t n_entries;
+    uint32_t n_top;             /* children of the root */
+    char *names;
+
+    /* lowercase name trigrams, postings[starts[k]..starts[k+1]) are the
+     * entries containing keys[k], in entry order */
+    uint32_t *keys;
+    uint32_t *starts;
+    uint32_t n_keys;
+    uint32_t *postings;
+
+    unsigned int update_id;
+    time_t built;
+    int refs;
+};
+
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct search_index *current = NULL;
+static int building = 0;
+
+/* ------------------------------------------------------------------ */
+/* index                                                                */
+
+struct builder
+{
+    struct search_index *ix;
+    uint32_t max_entries;
+    size_t names_len;
+    size_t max_names;
+};
+
+static uint32_t add_entry(struct builder *b, uint32_t parent, const content_entry *ce)
+{
+    struct search_index *ix = b->ix;
+    size_t name_size = strlen(ce->name) + 1;
+
+    if (ix->n_entries == b->max_entries)
+    {
+        b->max_entries = b->max_entries ? b->max_entries * 2 : 1024;
+        safe_realloc((void **)&ix->entries, b->max_entries * sizeof(struct indexed_entry));
+    }
+    if (b->names_len + name_size > b->max_names)
+    {
+        b->max_names = (b->names_len + name_size) * 2;
+        safe_realloc((void **)&ix->names, b->max_names);
+    }
+
+    struct indexed_entry *e = &ix->entries[ix->n_entries];
+    memset(e, 0, sizeof(*e));
+    e->size = ce->size;
+    e->parent = parent;
+    e->name = b->names_len;
+    e->mime = ce->type == T_DIR ? MIME_DIR : get_mime_index(ce->mime);
+
+    memcpy(ix->names + b->names_len, ce->name, name_size);
+    b->names_len += name_size;
+
+    return ix->n_entries++;
+}
+
+/* index the folder at path (relative to media_dir, len chars long) */
+static void index_dir(struct builder *b, char *path, size_t len, uint32_t parent)
+{
+    directory_listing dl = { .entries = NULL, .length = 0 };
+
+    if (scan_directory(len ? path : ".", &dl) <= 0)
+        return;
+
+    uint32_t first = b->ix->n_entries;
+    for (int i = 0; i < dl.length; i++)
+        add_entry(b, parent, dl.entries[i]);
+    free_directory_listing(&dl);
+
+    uint32_t last = b->ix->n_entries;
+    if (parent == NO_PARENT)
+        b->ix->n_top = last - first;
+    else
+    {
+        b->ix->entries[parent].children = first;
+        b->ix->entries[parent].n_children = last - first;
+    }
+
+    for (uint32_t i = first; i < last; i++)
+    {
+        if (b->ix->entries[i].mime == MIME_DIR)
+        {
+            const char *name = b->ix->names + b->ix->entries[i].name;
+            int n = snprintf(path + len, PATH_MAX - len, "%s%s", len ? "/" : "", name);
+
+            if (n > 0 && len + n < PATH_MAX)
+                index_dir(b, path, len + n, i);
+            path[len] = '\0';
+
+            // a folder that couldn't be read has an empty subtree
+            if (b->ix->entries[i].children == 0)
+                b->ix->entries[i].children = b->ix->n_entries;
+            b->ix->entries[i].subtree_end = b->ix->n_entries;
+        }
+    }
+}
+
+static int compare_u64(const void *aa, const void *bb)
+{
+    uint64_t a = *(const uint64_t *)aa;
+    uint64_t b = *(const uint64_t *)bb;
+
+    return a < b ? -1 : a > b;
+}
+
+static void build_trigrams(struct search_index *ix)
+{
+    size_t n_pairs = 0, max_pairs = 0;
+    uint64_t *pairs = NULL;
+
+    for (uint32_t i = 0; i < ix->n_entries; i++)
+    {
+        const unsigned char *p = (const unsigned char *)ix->names + ix->entries[i].name;
+
+        for (; p[0] && p[1] && p[2]; p++)
+        {
+            if (n_pairs == max_pairs)
+            {
+                max_pairs = max_pairs ? max_pairs * 2 : 4096;
+                safe_realloc((void **)&pairs, max_pairs * sizeof(uint64_t));
+            }
+
+            uint32_t key = tolower(p[0]) << 16 | tolower(p[1]) << 8 | tolower(p[2]);
+            pairs[n_pairs++] = (uint64_t)key << 32 | i;
+        }
+    }
+
+    qsort(pairs, n_pairs, sizeof(uint64_t), compare_u64);
+
+    ix->keys = safe_malloc((n_pairs + 1) * sizeof(uint32_t));
+    ix->starts = safe_malloc((n_pairs + 2) * sizeof(uint32_t));
+    ix->postings = safe_malloc((n_pairs + 1) * sizeof(uint32_t));
+    ix->n_keys = 0;
+
+    uint32_t n_postings = 0;
+    for (size_t k = 0; k < n_pairs; k++)
+    {
+        // a name repeating a trigram is listed once
+        if (k > 0 && pairs[k] == pairs[k - 1])
+            continue;
+
+        uint32_t key = pairs[k] >> 32;
+        if (ix->n_keys == 0 || ix->keys[ix->n_keys - 1] != key)
+        {
+            ix->keys[ix->n_keys] = key;
+            ix->starts[ix->n_keys++] = n_postings;
+        }
+        ix->postings[n_postings++] = (uint32_t)pairs[k];
+    }
+    ix->starts[ix->n_keys] = n_postings;
+
+    free(pairs);
+
+    safe_realloc((void **)&ix->keys, (ix->n_keys + 1) * sizeof(uint32_t));
+    safe_realloc((void **)&ix->starts, (ix->n_keys + 1) * sizeof(uint32_t));
+    safe_realloc((void **)&ix->postings, (n_postings + 1) * sizeof(uint32_t));
+}
+
+static void free_search_index(struct search_index *ix)
+{
+    free(ix->entries);
+    free(ix->names);
+    free(ix->keys);
+    free(ix->starts);
+    free(ix->postings);
+    free(ix);
+}
+
+static void *build_thread(void *unused)
+{
+    struct search_index *ix = safe_malloc(sizeof(struct search_index));
+    memset(ix, 0, sizeof(*ix));
+    ix->refs = 1;               /* held by current */
+
+    // changes made while scanning trigger the next rebuild
+    ix->update_id = mediawatch_system_update_id();
+    ix->built = time(NULL);
+
+    struct builder b = { .ix = ix };
+    char path[PATH_MAX] = "";
+
+    if (chdir_to_media_dir() == 0)
+        index_dir(&b, path, 0, NO_PARENT);
+    else
+        PRINT_LOG(E_ERROR, "Search index: failed to enter %s\n", media_dir);
+
+    build_trigrams(ix);
+
+    PRINT_LOG(E_INFO, "Search index: %u entries, %u trigrams, %ld seconds\n",
+              ix->n_entries, ix->n_keys, (long)(time(NULL) - ix->built));
+
+    pthread_mutex_lock(&search_lock);
+
+    // the old index goes once its last reader is done
+    struct search_index *old = current;
+    current = ix;
+    building = 0;
+    if (old && --old->refs == 0)
+        free_search_index(old);
+
+    pthread_mutex_unlock(&search_lock);
+
+    return NULL;
+}
+
+/* called with search_lock held */
+static void start_build(void)
+{
+    pthread_attr_t attrs;
+    pthread_attr_init(&attrs);
+    pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thr;
+    int r = pthread_create(&thr, &attrs, build_thread, NULL);
+    if (r != 0)
+        PRINT_LOG(E_ERROR, "Failed to start the search index thread: %d\n", r);
+    else
+        building = 1;
+
+    pthread_attr_destroy(&attrs);
+}
+
+void init_search(void)
+{
+    if (!enable_search)
+        return;
+
+    pthread_mutex_lock(&search_lock);
+    start_build();
+    pthread_mutex_unlock(&search_lock);
+}
+
+struct search_index *acquire_search_index(void)
+{
+    pthread_mutex_lock(&search_lock);
+
+    struct search_index *ix = current;
+
+    // a stale index still answers until its replacement is ready
+    if (!building && ix && (ix->update_id != mediawatch_system_update_id()
+                            || time(NULL) - ix->built > SEARCH_INDEX_MAX_AGE))
+        start_build();
+
+    if (ix)
+        ix->refs++;
+
+    pthread_mutex_unlock(&search_lock);
+
+    return ix;
+}
+
+void release_search_index(struct search_index *ix)
+{
+    pthread_mutex_lock(&search_lock);
+    if (--ix->refs == 0)
+        free_search_index(ix);
+    pthread_mutex_unlock(&search_lock);
+}
+
+/* ------------------------------------------------------------------ */
+/* criteria                                                             */
+
+enum query_op
+{
+    Q_TRUE,
+    Q_FALSE,
+    Q_AND,
+    Q_OR,
+    Q_EQUAL,
+    Q_NOT_EQUAL,
+    Q_CONTAINS,
+    Q_NOT_CONTAINS,
+    Q_STARTS_WITH,
+    Q_DERIVED_FROM,
+};
+
+enum query_property
+{
+    P_TITLE,
+    P_CLASS,
+};
+
+struct search_query
+{
+    enum query_op op;
+    enum query_property prop;
+    struct search_query *left;
+    struct search_query *right;
+    char value[];
+};
+
+enum token
+{
+    T_END,
+    T_OPEN,
+    T_CLOSE,
+    T_WORD,
+    T_STRING,
+    T_ERROR,
+};
+
+struct parser
+{
+    const char *p;
+    enum token tok;
+    char text[1024];
+};
+
+static int is_operator_char(char c)
+{
+    return c == '=' || c == '!' || c == '<' || c == '>';
+}
+
+static void next_token(struct parser *ps)
+{
+    size_t n = 0;
+
+    while (isspace((unsigned char)*ps->p))
+        ps->p++;
+
+    if (*ps->p == '\0')
+    {
+        ps->tok = T_END;
+        return;
+    }
+
+    if (*ps->p == '(' || *ps->p == ')')
+    {
+        ps->tok = *ps->p++ == '(' ? T_OPEN : T_CLOSE;
+        return;
+    }
+
+    if (*ps->p == '"')
+    {
+        // quoted value, \" and \\ are escapes
+        for (ps->p++; *ps->p != '"'; ps->p++)
+        {
+            if (*ps->p == '\\' && ps->p[1] != '\0')
+                ps->p++;
+            if (*ps->p == '\0' || n == sizeof(ps->text) - 1)
+            {
+                ps->tok = T_ERROR;
+                return;
+            }
+            ps->text[n++] = *ps->p;
+        }
+        ps->p++;
+        ps->text[n] = '\0';
+        ps->tok = T_STRING;
+        return;
+    }
+
+    // a property, a keyword or an operator
+    int op = is_operator_char(*ps->p);
+    while (*ps->p && !isspace((unsigned char)*ps->p) && *ps->p != '(' && *ps->p != ')'
+           && *ps->p != '"' && is_operator_char(*ps->p) == op && n < sizeof(ps->text) - 1)
+        ps->text[n++] = *ps->p++;
+
+    ps->text[n] = '\0';
+    ps->tok = T_WORD;
+}
+
+static struct search_query *new_node(enum query_op op, const char *value)
+{
+    size_t size = value ? strlen(value) + 1 : 1;
+    struct search_query *q = safe_malloc(sizeof(struct search_query) + size);
+
+    memset(q, 0, sizeof(struct search_query));
+    q->op = op;
+    q->value[0] = '\0';
+    if (value)
+        memcpy(q->value, value, size);
+
+    return q;
+}
+
+void free_search_query(struct search_query *q)
+{
+    if (!q)
+        return;
+    free_search_query(q->left);
+    free_search_query(q->right);
+    free(q);
+}
+
+static struct search_query *parse_or(struct parser *ps);
+
+/* relExp: property op "value" or property exists true|false */
+static struct search_query *parse_relation(struct parser *ps)
+{
+    char prop[64];
+
+    if (ps->tok != T_WORD || strlen(ps->text) >= sizeof(prop))
+        return NULL;
+    strcpy(prop, ps->text);
+
+    next_token(ps);
+    if (ps->tok != T_WORD)
+        return NULL;
+
+    if (strcasecmp(ps->text, "exists") == 0)
+    {
+        next_token(ps);
+        if (ps->tok != T_WORD)
+            return NULL;
+
+        int want = strcasecmp(ps->text, "true") == 0;
+        if (!want && strcasecmp(ps->text, "false") != 0)
+            return NULL;
+
+        // objects here never refer to others, everything else is always set
+        int has;
+        if (strcmp(prop, "@refID") == 0)
+            has = 0;
+        else if (strcmp(prop, "dc:title") == 0 || strcmp(prop, "upnp:class") == 0
+                 || strcmp(prop, "@id") == 0 || strcmp(prop, "@parentID") == 0)
+            has = 1;
+        else
+            return NULL;
+
+        next_token(ps);
+        return new_node(has == want ? Q_TRUE : Q_FALSE, NULL);
+    }
+
+    enum query_property p;
+    if (strcmp(prop, "dc:title") == 0)
+        p = P_TITLE;
+    else if (strcmp(prop, "upnp:class") == 0)
+        p = P_CLASS;
+    else
+        return NULL;
+
+    enum query_op op;
+    if (strcmp(ps->text, "=") == 0)
+        op = Q_EQUAL;
+    else if (strcmp(ps->text, "!=") == 0)
+        op = Q_NOT_EQUAL;
+    else if (strcasecmp(ps->text, "contains") == 0)
+        op = Q_CONTAINS;
+    else if (strcasecmp(ps->text, "doesNotContain") == 0)
+        op = Q_NOT_CONTAINS;
+    else if (strcasecmp(ps->text, "startsWith") == 0)
+        op = Q_STARTS_WITH;
+    else if (strcasecmp(ps->text, "derivedfrom") == 0)
+        op = Q_DERIVED_FROM;
+    else
+        return NULL;
+
+    next_token(ps);
+    if (ps->tok != T_STRING)
+        return NULL;
+
+    struct search_query *q = new_node(op, ps->text);
+    q->prop = p;
+
+    next_token(ps);
+    return q;
+}
+
+static struct search_query *parse_primary(struct parser *ps)
+{
+    if (ps->tok != T_OPEN)
+        return parse_relation(ps);
+
+    next_token(ps);
+    struct search_query *q = parse_or(ps);
+    if (!q || ps->tok != T_CLOSE)
+    {
+        free_search_query(q);
+        return NULL;
+    }
+
+    next_token(ps);
+    return q;
+}
+
+/* 'and' binds tighter than 'or' */
+static struct search_query *parse_binary(struct parser *ps, const char *keyword,
+                                         enum query_op op,
+                                         struct search_query *(*operand)(struct parser *))
+{
+    struct search_query *q = operand(ps);
+
+    while (q && ps->tok == T_WORD && strcasecmp(ps->text, keyword) == 0)
+    {
+        next_token(ps);
+
+        struct search_query *right = operand(ps);
+        if (!right)
+        {
+            free_search_query(q);
+            return NULL;
+        }
+
+        struct search_query *n = new_node(op, NULL);
+        n->left = q;
+        n->right = right;
+        q = n;
+    }
+
+    return q;
+}
+
+static struct search_query *parse_and(struct parser *ps)
+{
+    return parse_binary(ps, "and", Q_AND, parse_primary);
+}
+
+static struct search_query *parse_or(struct parser *ps)
+{
+    return parse_binary(ps, "or", Q_OR, parse_and);
+}
+
+struct search_query *parse_search_criteria(const char *criteria)
+{
+    struct parser ps = { .p = criteria };
+
+    next_token(&ps);
+
+    // "*" matches everything
+    if (ps.tok == T_WORD && strcmp(ps.text, "*") == 0)
+    {
+        next_token(&ps);
+        return ps.tok == T_END ? new_node(Q_TRUE, NULL) : NULL;
+    }
+
+    struct search_query *q = parse_or(&ps);
+    if (q && ps.tok != T_END)
+    {
+        free_search_query(q);
+        return NULL;
+    }
+
+    return q;
+}
+
+/* ------------------------------------------------------------------ */
+/* queries                                                              */
+
+static const char *entry_class(const struct indexed_entry *e, char *buf, size_t size)
+{
+    if (e->mime == MIME_DIR)
+        return "object.container.storageFolder";
+
+    snprintf(buf, size, "object.item.%sItem",
+             mime_type_to_text(get_mime_by_index(e->mime)->type));
+    return buf;
+}
+
+static int match(const struct search_query *q, const struct search_index *ix, uint32_t i)
+{
+    const struct indexed_entry *e = &ix->entries[i];
+    char buf[32];
+    const char *v;
+    size_t len;
+
+    switch (q->op)
+    {
+    case Q_TRUE:
+        return 1;
+    case Q_FALSE:
+        return 0;
+    case Q_AND:
+        return match(q->left, ix, i) && match(q->right, ix, i);
+    case Q_OR:
+        return match(q->left, ix, i) || match(q->right, ix, i);
+    default:
+        break;
+    }
+
+    v = q->prop == P_TITLE ? ix->names + e->name : entry_class(e, buf, sizeof(buf));
+
+    switch (q->op)
+    {
+    case Q_EQUAL:
+        return strcasecmp(v, q->value) == 0;
+    case Q_NOT_EQUAL:
+        return strcasecmp(v, q->value) != 0;
+    case Q_CONTAINS:
+        return strcasestr(v, q->value) != NULL;
+    case Q_NOT_CONTAINS:
+        return strcasestr(v, q->value) == NULL;
+    case Q_STARTS_WITH:
+        return strncasecmp(v, q->value, strlen(q->value)) == 0;
+    case Q_DERIVED_FROM:
+        len = strlen(q->value);
+        return strncasecmp(v, q->value, len) == 0 && (v[len] == '\0' || v[len] == '.');
+    default:
+        return 0;
+    }
+}
+
+/* a title every match must contain, long enough to look up by trigram */
+static const char *required_term(const struct search_query *q)
+{
+    if (q->op == Q_CONTAINS && q->prop == P_TITLE && strlen(q->value) >= 3)
+        return q->value;
+
+    if (q->op == Q_AND)
+    {
+        const char *l = required_term(q->left);
+        const char *r = required_term(q->right);
+        if (!l || (r && strlen(r) > strlen(l)))
+            return r;
+        return l;
+    }
+
+    return NULL;
+}
+
+/* shortest posting list among the term's trigrams, NULL when one is missing */
+static const uint32_t *lookup_term(const struct search_index *ix, const char *term,
+                                   uint32_t *n)
+{
+    const uint32_t *best = NULL;
+    uint32_t best_n = 0;
+
+    for (const unsigned char *p = (const unsigned char *)term; p[0] && p[1] && p[2]; p++)
+    {
+        uint32_t key = tolower(p[0]) << 16 | tolower(p[1]) << 8 | tolower(p[2]);
+        uint32_t lo = 0, hi = ix->n_keys;
+
+        while (lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (ix->keys[mid] < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == ix->n_keys || ix->keys[lo] != key)
+        {
+            *n = 0;
+            return NULL;
+        }
+
+        uint32_t len = ix->starts[lo + 1] - ix->starts[lo];
+        if (!best || len < best_n)
+        {
+            best = ix->postings + ix->starts[lo];
+            best_n = len;
+        }
+    }
+
+    *n = best_n;
+    return best;
+}
+
+/* subtree range of a container, 0 if there is no such folder */
+static int find_container(const struct search_index *ix, const char *path,
+                          uint32_t *lo, uint32_t *hi)
+{
+    uint32_t first = 0, n = ix->n_top;
+
+    *lo = 0;
+    *hi = ix->n_entries;
+
+    while (*path)
+    {
+        const char *slash = strchr(path, '/');
+        size_t len = slash ? (size_t)(slash - path) : strlen(path);
+        uint32_t i;
+
+        for (i = first; i < first + n; i++)
+        {
+            const struct indexed_entry *e = &ix->entries[i];
+            const char *name = ix->names + e->name;
+
+            if (e->mime == MIME_DIR && strncmp(name, path, len) == 0 && name[len] == '\0')
+                break;
+        }
+        if (i == first + n)
+            return 0;
+
+        first = ix->entries[i].children;
+        n = ix->entries[i].n_children;
+        *lo = first;
+        *hi = ix->entries[i].subtree_end;
+
+        path += len;
+        while (*path == '/')
+            path++;
+    }
+
+    return 1;
+}
+
+/* object id of the folder holding entry i */
+static const char *parent_path(const struct search_index *ix, uint32_t i, char *buf)
+{
+    char *w = buf + PATH_MAX - 1;
+    *w = '\0';
+
+    for (uint32_t p = ix->entries[i].parent; p != NO_PARENT; p = ix->entries[p].parent)
+    {
+        const char *name = ix->names + ix->entries[p].name;
+        size_t len = strlen(name);
+
+        if ((size_t)(w - buf) < len + 1)
+            break;
+        if (*w)
+            *--w = '/';
+        w -= len;
+        memcpy(w, name, len);
+    }
+
+    return w;
+}
+
+int search_index_query(const struct search_index *ix, const char *container,
+                       const struct search_query *q, int start, int count,
+                       void (*emit)(void *ctx, const struct search_hit *hit), void *ctx)
+{
+    uint32_t lo, hi;
+    if (!find_container(ix, container, &lo, &hi))
+        return -1;
+
+    const uint32_t *candidates = NULL;
+    uint32_t n_candidates = hi - lo;
+
+    const char *term = required_term(q);
+    if (term && !(candidates = lookup_term(ix, term, &n_candidates)))
+        return 0;
+
+    char dirpath[PATH_MAX];
+    uint32_t dirpath_of = NO_PARENT - 1;
+    int total = 0;
+
+    for (uint32_t k = 0; k < n_candidates; k++)
+    {
+        uint32_t i = candidates ? candidates[k] : lo + k;
+        if (i < lo || i >= hi || !match(q, ix, i))
+            continue;
+
+        if (total >= start && (count < 0 || total < start + count))
+        {
+            const struct indexed_entry *e = &ix->entries[i];
+            struct search_hit hit;
+
+            // siblings come in a row, their parent is only looked up once
+            if (e->parent != dirpath_of)
+            {
+                const char *p = parent_path(ix, i, dirpath);
+                memmove(dirpath, p, strlen(p) + 1);
+                dirpath_of = e->parent;
+            }
+
+            hit.dirpath = dirpath;
+            hit.name = ix->names + e->name;
+            hit.type = e->mime == MIME_DIR ? T_DIR : T_FILE;
+            hit.size = e->size;
+            hit.mime = e->mime == MIME_DIR ? NULL : get_mime_by_index(e->mime);
+            emit(ctx, &hit);
+        }
+        total++;
+    }
+
+    return total;
+}
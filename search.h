@@ -0,0 +1,65 @@
+#pragma once
+/*
+ *
+ * This file is part of MicroDLNA:
+ * Copyright (c) 2025, Michael Walsh
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * The name of the author may not be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include "dirlist.h"
+
+struct search_index;
+struct search_query;
+
+struct search_hit
+{
+    const char *dirpath;        /* object id of the parent, "" for the root */
+    const char *name;
+    filetype type;
+    off_t size;
+    const struct ext_info *mime;
+};
+
+/* start building the index when search is enabled */
+void init_search(void);
+
+/* NULL when the criteria can't be parsed or use unsupported properties */
+struct search_query *parse_search_criteria(const char *criteria);
+
+void free_search_query(struct search_query *q);
+
+/* the current index, NULL until the first one is built */
+struct search_index *acquire_search_index(void);
+
+void release_search_index(struct search_index *ix);
+
+/* call emit for the matches below container from start on, at most count
+ * of them (-1 for all), returns the number of matches or -1 when the
+ * container is unknown */
+int search_index_query(const struct search_index *ix, const char *container,
+                       const struct search_query *q, int start, int count,
+                       void (*emit)(void *ctx, const struct search_hit *hit), void *ctx);
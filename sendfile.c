@@ -21,10 +21,17 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdint.h>
 
+#include "globalvars.h"
+#include "iouring.h"
 #include "sendfile.h"
 #include "utils.h"
 #include "log.h"
@@ -32,8 +39,29 @@
 /* Max bytes per sendfile() call (2^31-1): keeps count in 32-bit range, avoids huge
  * single kernel transfers. Only used when HAVE_SYS_SENDFILE. */
 #define SENDFILE_MAX_TRANSFER 2147483647
-/* Fallback read/write buffer size (64 KiB): one allocation, decent throughput. */
-#define BUFFER_SIZE 65536
+/* Piece moved by each splice() or read/write when sendfile() cannot be
+ * used, the read/write buffer is allocated once per worker. */
+#define COPY_BUFFER_SIZE (256 << 10)
+/* File systems remembered as unable to sendfile() or splice() */
+#define MAX_ODD_DEVICES 16
+#define NO_SENDFILE 0x01
+#define NO_SPLICE 0x02
+
+/* Transfers at least this long are treated as streaming: the file is read
+ * ahead of the socket and, for large files, dropped behind it. */
+#define STREAMING_MIN (8 << 20)
+/* Files this large do not keep the pages a stream has already sent, so one
+ * stream does not evict the working set of the others. */
+#define DROP_BEHIND_MIN (64 << 20)
+/* Read ahead by this many seconds of the measured sending rate,
+ * within the window limits. */
+#define READAHEAD_SECONDS 4
+#define READAHEAD_MIN (1 << 20)
+#define READAHEAD_MAX (32 << 20)
+/* Paced transfers may send this many milliseconds of their rate at once,
+ * but at least PACING_MIN_BURST bytes. */
+#define PACING_BURST_MS 100
+#define PACING_MIN_BURST (64 << 10)
 
 #if defined(__linux__)
 
@@ -41,6 +69,8 @@
 
 #include <sys/sendfile.h>
 
+#define HAVE_SPLICE
+
 static inline int sys_sendfile(int sock, int sendfd, off_t *offset, off_t len)
 {
     return sendfile(sock, sendfd, offset, (size_t)len);
@@ -85,61 +115,431 @@ static inline int sys_sendfile(int sock, int sendfd, off_t *offset, off_t len)
 
 
 
-void send_file(int socketfd, int sendfd, off_t offset, off_t end_offset)
+struct readahead
+{
+    int fd;
+    int active;
+    int drop_behind;
+    off_t end;
+    off_t window;
+    off_t ahead;        // read ahead up to here
+    off_t dropped;      // pages below here were dropped
+    off_t started_at;
+    struct timespec start;
+};
+
+static void readahead_start(struct readahead *ra, int fd, off_t offset, off_t end_offset,
+                            const struct stat *st)
+{
+    ra->fd = fd;
+    ra->active = end_offset - offset + 1 >= STREAMING_MIN;
+    ra->drop_behind = 0;
+    ra->end = end_offset + 1;
+    ra->window = READAHEAD_MIN;
+    ra->ahead = offset;
+    ra->dropped = offset;
+    ra->started_at = offset;
+    clock_gettime(CLOCK_MONOTONIC, &ra->start);
+
+    if (!ra->active)
+        return;
+
+    ra->drop_behind = st != NULL && st->st_size >= DROP_BEHIND_MIN;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, offset, ra->end - offset, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+/* offset is what the socket has taken so far, keep the disk a window
+ * ahead of it, the window follows the sending rate */
+static void readahead_advance(struct readahead *ra, off_t offset)
+{
+    if (!ra->active)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - ra->start.tv_sec) + (now.tv_nsec - ra->start.tv_nsec) / 1e9;
+
+    if (elapsed > 0.1)
+    {
+        double rate = (offset - ra->started_at) / elapsed;
+        off_t window = (off_t)(rate * READAHEAD_SECONDS);
+
+        if (window < READAHEAD_MIN)
+            window = READAHEAD_MIN;
+        else if (window > READAHEAD_MAX)
+            window = READAHEAD_MAX;
+
+        ra->window = window;
+    }
+
+    if (ra->ahead - offset < ra->window / 2 && ra->ahead < ra->end)
+    {
+        off_t from = ra->ahead > offset ? ra->ahead : offset;
+        off_t len = offset + ra->window - from;
+        if (from + len > ra->end)
+            len = ra->end - from;
+
+#if defined(__linux__)
+        readahead(ra->fd, from, (size_t)len);
+#elif defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(ra->fd, from, len, POSIX_FADV_WILLNEED);
+#endif
+        ra->ahead = from + len;
+    }
+
+#ifdef POSIX_FADV_DONTNEED
+    // keep a window behind in case the client steps back a little
+    if (ra->drop_behind && offset - ra->dropped > 2 * ra->window)
+    {
+        off_t upto = offset - ra->window;
+        posix_fadvise(ra->fd, ra->dropped, upto - ra->dropped, POSIX_FADV_DONTNEED);
+        ra->dropped = upto;
+    }
+#endif
+}
+
+/* the largest piece to send before looking at the read ahead again */
+static off_t readahead_step(const struct readahead *ra, off_t max)
+{
+    if (ra->active && ra->window / 2 < max)
+        return ra->window / 2;
+    return max;
+}
+
+/* Token bucket for paced transfers. The rate of each transfer is the
+ * global cap shared evenly by the active transfers, bounded by the
+ * per-client cap, and is handed to the kernel as well where the
+ * socket supports a pacing rate. */
+struct pacer
+{
+    int sd;
+    int active;
+    off_t rate;         // bytes per second now applied
+    double tokens;
+    struct timespec last;
+};
+
+static pthread_mutex_t pacing_lock = PTHREAD_MUTEX_INITIALIZER;
+static int paced_transfers = 0;
+
+static off_t fair_rate(void)
+{
+    off_t rate = 0;
+
+    pthread_mutex_lock(&pacing_lock);
+    if (max_total_rate > 0)
+        rate = (off_t)max_total_rate * 1024 / (paced_transfers > 0 ? paced_transfers : 1);
+    pthread_mutex_unlock(&pacing_lock);
+
+    off_t client_rate = (off_t)max_client_rate * 1024;
+    if (client_rate > 0 && (rate == 0 || client_rate < rate))
+        rate = client_rate;
+
+    return rate;
+}
+
+static void set_pacing_rate(int sd, off_t rate)
+{
+#ifdef SO_MAX_PACING_RATE
+    unsigned int value = rate > 0 && rate < UINT32_MAX ? (unsigned int)rate : UINT32_MAX;
+
+    if (setsockopt(sd, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof(value)) < 0)
+        PRINT_LOG(E_DEBUG, "setsockopt(SO_MAX_PACING_RATE): %d\n", errno);
+#endif
+}
+
+static double seconds_since(struct timespec *last)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double elapsed = (now.tv_sec - last->tv_sec) + (now.tv_nsec - last->tv_nsec) / 1e9;
+    *last = now;
+    return elapsed;
+}
+
+static void pacer_start(struct pacer *pc, int sd)
+{
+    pc->sd = sd;
+    pc->active = max_client_rate > 0 || max_total_rate > 0;
+    pc->rate = 0;
+    pc->tokens = 0;
+
+    if (!pc->active)
+        return;
+
+    pthread_mutex_lock(&pacing_lock);
+    paced_transfers++;
+    pthread_mutex_unlock(&pacing_lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &pc->last);
+}
+
+static void pacer_end(struct pacer *pc)
+{
+    if (!pc->active)
+        return;
+
+    pthread_mutex_lock(&pacing_lock);
+    paced_transfers--;
+    pthread_mutex_unlock(&pacing_lock);
+
+    // the connection may carry other requests
+    if (pc->rate > 0)
+        set_pacing_rate(pc->sd, 0);
+}
+
+/* how much of want may be sent now, waits for the bucket to refill */
+static off_t pacer_allow(struct pacer *pc, off_t want)
+{
+    if (!pc->active)
+        return want;
+
+    off_t rate = fair_rate();
+    if (rate != pc->rate)
+    {
+        set_pacing_rate(pc->sd, rate);
+        pc->rate = rate;
+    }
+
+    off_t burst = rate * PACING_BURST_MS / 1000;
+    if (burst < PACING_MIN_BURST)
+        burst = PACING_MIN_BURST;
+    if (want > burst)
+        want = burst;
+
+    pc->tokens += seconds_since(&pc->last) * rate;
+    if (pc->tokens > burst)
+        pc->tokens = burst;
+
+    if (pc->tokens < want)
+    {
+        double wait = (want - pc->tokens) / rate;
+        struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+
+        pc->tokens += seconds_since(&pc->last) * rate;
+    }
+
+    return want;
+}
+
+static void pacer_sent(struct pacer *pc, off_t sent)
+{
+    if (pc->active)
+        pc->tokens -= sent;
+}
+
+/* File systems where sendfile() or splice() turned out unsupported,
+ * transfers from them go straight to the next method. */
+struct odd_device
+{
+    dev_t dev;
+    int flags;
+};
+
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct odd_device odd_devices[MAX_ODD_DEVICES];
+static int n_odd_devices = 0;
+
+static int device_flags(const struct stat *st)
+{
+    int flags = 0;
+
+    if (st == NULL)
+        return 0;
+
+    pthread_mutex_lock(&devices_lock);
+    for (int i = 0; i < n_odd_devices; i++)
+    {
+        if (odd_devices[i].dev == st->st_dev)
+            flags = odd_devices[i].flags;
+    }
+    pthread_mutex_unlock(&devices_lock);
+
+    return flags;
+}
+
+/* only remember errors saying the file system cannot do it,
+ * anything else may be about this file or this client */
+static void device_unsupported(const struct stat *st, int flag, int err)
+{
+    if (st == NULL || (err != EINVAL && err != ENOSYS && err != EOPNOTSUPP))
+        return;
+
+    pthread_mutex_lock(&devices_lock);
+    int i;
+    for (i = 0; i < n_odd_devices; i++)
+    {
+        if (odd_devices[i].dev == st->st_dev)
+            break;
+    }
+    if (i < MAX_ODD_DEVICES)
+    {
+        if (i == n_odd_devices)
+            odd_devices[n_odd_devices++] = (struct odd_device) { st->st_dev, 0 };
+        odd_devices[i].flags |= flag;
+        PRINT_LOG(E_INFO, "No %s from device %jx [%d]\n",
+                  flag == NO_SENDFILE ? "sendfile" : "splice", (uintmax_t)st->st_dev, err);
+    }
+    pthread_mutex_unlock(&devices_lock);
+}
+
+/* Each method returns 0 once the range is sent, -1 if the client went
+ * away and 1 if the next method should go on from *offset. */
+
+#if defined(HAVE_SYS_SENDFILE)
+static int sendfile_range(int socketfd, int sendfd, off_t *offset, off_t end_offset,
+                          const struct stat *st, struct readahead *ra, struct pacer *pc)
 {
     off_t send_size;
     off_t ret;
 
-#if defined(HAVE_SYS_SENDFILE)
-    static int try_sendfile = 1;
+    while (*offset <= end_offset)
+    {
+        readahead_advance(ra, *offset);
+
+        send_size = end_offset - *offset + 1;
+        if (send_size > readahead_step(ra, SENDFILE_MAX_TRANSFER))
+            send_size = readahead_step(ra, SENDFILE_MAX_TRANSFER);
+        send_size = pacer_allow(pc, send_size);
+
+        PRINT_LOG(E_DEBUG, "sendfile range %jd to %jd\n", (intmax_t)*offset,
+                  (intmax_t)send_size);
+        ret = sys_sendfile(socketfd, sendfd, offset, send_size);
+        if (ret > 0)
+            pacer_sent(pc, ret);
+        if (ret == -1)
+        {
+            /* Client closed connection */
+            if (errno == EPIPE)
+                return -1;
+
+            int err = errno;
+            PRINT_LOG(E_DEBUG, "sendfile error :: error no. %d\n", err);
+            device_unsupported(st, NO_SENDFILE, err);
+            return 1;
+        }
+        if (ret == 0)
+        {
+            /* No progress (e.g. socket buffer full or kernel quirk). Avoid infinite loop. */
+            PRINT_LOG(E_DEBUG, "sendfile returned 0, falling back\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+#if defined(HAVE_SPLICE)
+/* each worker keeps a pipe to splice through */
+static __thread int splice_pipe[2] = { -1, -1 };
 
-    if (try_sendfile)
+static void close_splice_pipe(void)
+{
+    close(splice_pipe[0]);
+    close(splice_pipe[1]);
+    splice_pipe[0] = splice_pipe[1] = -1;
+}
+
+static int splice_range(int socketfd, int sendfd, off_t *offset, off_t end_offset,
+                        const struct stat *st, struct readahead *ra, struct pacer *pc)
+{
+    if (splice_pipe[0] < 0)
     {
-        while (offset <= end_offset)
+        if (pipe2(splice_pipe, O_CLOEXEC) < 0)
         {
-            send_size = end_offset - offset + 1;
-            if (send_size > SENDFILE_MAX_TRANSFER)
-                send_size = SENDFILE_MAX_TRANSFER;
-
-            PRINT_LOG(E_DEBUG, "sendfile range %jd to %jd\n", (intmax_t)offset,
-                      (intmax_t)send_size);
-            ret = sys_sendfile(socketfd, sendfd, &offset, send_size);
-            if (ret == -1)
-            {
-                /* Client closed connection */
-                if (errno == EPIPE)
-                    break;
+            PRINT_LOG(E_ERROR, "pipe2(): %d\n", errno);
+            splice_pipe[0] = splice_pipe[1] = -1;
+            return 1;
+        }
+        // best effort, the default pipe holds 64 KiB
+        fcntl(splice_pipe[1], F_SETPIPE_SZ, COPY_BUFFER_SIZE);
+    }
 
-                PRINT_LOG(E_DEBUG, "sendfile error :: error no. %d\n", errno);
-                /* Fall back to read/write on any sendfile error. */
-                goto fallback;
-            }
-            if (ret == 0)
+    while (*offset <= end_offset)
+    {
+        readahead_advance(ra, *offset);
+
+        off_t send_size = end_offset - *offset + 1;
+        if (send_size > COPY_BUFFER_SIZE)
+            send_size = COPY_BUFFER_SIZE;
+        send_size = pacer_allow(pc, send_size);
+
+        loff_t in_offset = *offset;
+        ssize_t in = splice(sendfd, &in_offset, splice_pipe[1], NULL, (size_t)send_size,
+                            SPLICE_F_MOVE);
+        if (in < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // nothing is left in the pipe, the next method starts here
+            int err = errno;
+            PRINT_LOG(E_DEBUG, "splice error :: error no. %d\n", err);
+            device_unsupported(st, NO_SPLICE, err);
+            return 1;
+        }
+        if (in == 0)
+        {
+            /* file shrunk under us */
+            PRINT_LOG(E_DEBUG, "splice error :: unexpected end of file\n");
+            return -1;
+        }
+
+        while (in > 0)
+        {
+            int more = *offset + in <= end_offset ? SPLICE_F_MORE : 0;
+            ssize_t out = splice(splice_pipe[0], NULL, socketfd, NULL, (size_t)in,
+                                 SPLICE_F_MOVE | more);
+            if (out < 0 && errno == EINTR)
+                continue;
+            if (out <= 0)
             {
-                /* No progress (e.g. socket buffer full or kernel quirk). Avoid infinite loop. */
-                PRINT_LOG(E_DEBUG, "sendfile returned 0, falling back to read/write\n");
-                goto fallback;
+                // what is left in the pipe is lost with the client
+                PRINT_LOG(E_DEBUG, "splice write error :: error no. %d\n", errno);
+                close_splice_pipe();
+                return -1;
             }
-        }
-        return;
 
-fallback:
-        try_sendfile = 0;
+            pacer_sent(pc, out);
+            *offset += out;
+            in -= out;
+        }
     }
+
+    return 0;
+}
 #endif
 
-    /* Fall back to regular I/O */
-    PRINT_LOG(E_DEBUG, "Falling back on regular I/O: error no. %d\n", errno);
-    char *buf = safe_malloc(BUFFER_SIZE);
+/* each worker keeps its copy buffer */
+static __thread char *copy_buffer = NULL;
 
-    while (offset <= end_offset)
+static int copy_range(int socketfd, int sendfd, off_t *offset, off_t end_offset,
+                      struct readahead *ra, struct pacer *pc)
+{
+    off_t send_size;
+    off_t ret;
+
+    if (copy_buffer == NULL)
+        copy_buffer = safe_malloc(COPY_BUFFER_SIZE);
+
+    while (*offset <= end_offset)
     {
-        send_size = end_offset - offset + 1;
-        if (send_size > (off_t)BUFFER_SIZE)
-            send_size = BUFFER_SIZE;
+        readahead_advance(ra, *offset);
+
+        send_size = end_offset - *offset + 1;
+        if (send_size > (off_t)COPY_BUFFER_SIZE)
+            send_size = COPY_BUFFER_SIZE;
+        send_size = pacer_allow(pc, send_size);
 
-        lseek(sendfd, offset, SEEK_SET);
-        ret = read(sendfd, buf, (size_t)send_size);
+        ret = pread(sendfd, copy_buffer, (size_t)send_size, *offset);
         if (ret == -1)
         {
             PRINT_LOG(E_DEBUG, "read error :: error no. %d\n", errno);
@@ -148,7 +548,15 @@ fallback:
             else
                 break;
         }
-        ret = write(socketfd, buf, ret);
+        if (ret == 0)
+        {
+            /* file shrunk under us */
+            PRINT_LOG(E_DEBUG, "read error :: unexpected end of file\n");
+            break;
+        }
+        ret = write(socketfd, copy_buffer, ret);
+        if (ret > 0)
+            pacer_sent(pc, ret);
         if (ret == -1)
         {
             PRINT_LOG(E_DEBUG, "write error :: error no. %d\n", errno);
@@ -157,7 +565,56 @@ fallback:
             else
                 break;
         }
-        offset += ret;
+        *offset += ret;
     }
-    free(buf);
+
+    return *offset > end_offset ? 0 : -1;
+}
+
+static int transfer(int socketfd, int sendfd, off_t offset, off_t end_offset,
+                    struct pacer *pc)
+{
+    struct stat st_buf;
+    const struct stat *st = fstat(sendfd, &st_buf) == 0 ? &st_buf : NULL;
+
+    struct readahead ra;
+    readahead_start(&ra, sendfd, offset, end_offset, st);
+
+    int flags = device_flags(st);
+    int r = 1;
+
+    // paced transfers sleep between bursts on their own worker
+    if (!pc->active)
+        r = iouring_send_file(socketfd, sendfd, &offset, end_offset, ra.drop_behind);
+
+#if defined(HAVE_SYS_SENDFILE)
+    if (r == 1 && !(flags & NO_SENDFILE))
+        r = sendfile_range(socketfd, sendfd, &offset, end_offset, st, &ra, pc);
+#endif
+
+#if defined(HAVE_SPLICE)
+    if (r == 1 && !(flags & NO_SPLICE))
+        r = splice_range(socketfd, sendfd, &offset, end_offset, st, &ra, pc);
+#endif
+
+    if (r == 1)
+    {
+        PRINT_LOG(E_DEBUG, "Falling back on regular I/O\n");
+        r = copy_range(socketfd, sendfd, &offset, end_offset, &ra, pc);
+    }
+
+    return r;
+}
+
+int send_file(int socketfd, int sendfd, off_t offset, off_t end_offset)
+{
+    struct pacer pc;
+
+    set_traffic_class(socketfd, TRAFFIC_BULK);
+    pacer_start(&pc, socketfd);
+    int r = transfer(socketfd, sendfd, offset, end_offset, &pc);
+    pacer_end(&pc);
+    set_traffic_class(socketfd, TRAFFIC_CONTROL);
+
+    return r;
 }
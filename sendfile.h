@@ -21,4 +21,5 @@
  * along with MicroDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
 
-void send_file(int socketfd, int sendfd, off_t offset, off_t end_offset);
+/* returns 0 once the whole range has been sent */
+int send_file(int socketfd, int sendfd, off_t offset, off_t end_offset);
@@ -27,87 +27,364 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include "globalvars.h"
 #include "stream.h"
 #include "utils.h"
 
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+// room for "FFFFFFFF\r\n" reserved in wbuf when a chunk is opened
+#define CHUNK_HEADER_SIZE 10
+
+// first chunk of a body, doubled for each following one up to
+// max_chunk_size so the client can start parsing early
+#define FIRST_CHUNK_SIZE 4096
+
+// wbuf holds one chunk plus the response headers
+#define HEADER_ROOM 1024
+
+// static text shorter than this is copied, an iovec costs more
+#define MIN_STATIC_REF 32
+
+// wait for a full send buffer to drain on non-blocking sockets
+#define SEND_TIMEOUT_MS 5000
+
+/* Output is gathered into an iovec list and sent with one sendmsg()
+ * per segment. Formatted and borrowed text is copied into wbuf,
+ * static text is referenced in place. Chunked bodies get their size
+ * line patched in when the chunk is closed. */
 struct stream
 {
-    FILE *fh;
-    char buf[BUFFER_SIZE];
-    int pos;
+    int sd;
+    int error;
+
+    struct iovec iov[STREAM_MAX_IOV];
+    int n_iov;
+    char *wbuf;
+    size_t wbuf_size;
+    size_t wpos;
+
+    // iov holding the size line of the open chunk, -1 if none
+    int chunk_iov;
+    size_t chunk_len;
+    size_t chunk_limit;
+
+    // body held back to be sent with a Content-Length
+    int whole_body;
+    char *body;
+    size_t body_len;
+    size_t body_size;
+
+    // a kept-alive connection must see which bytes of the next
+    // request are already buffered
+    char rbuf[BUFFER_SIZE];
+    int rpos;
+    int rlen;
 };
 
-struct stream *sdopen(int sd)
+static size_t first_chunk_size(void)
 {
-    FILE *fh = fdopen(sd, "r+");
-
-    if (!fh)
-        return NULL;
+    size_t max = (size_t)max_chunk_size * 1024;
+    return max < FIRST_CHUNK_SIZE ? max : FIRST_CHUNK_SIZE;
+}
 
+struct stream *sdopen(int sd)
+{
     struct stream *s = safe_malloc(sizeof(struct stream));
-    s->fh = fh;
-    s->pos = 0;
+    s->sd = sd;
+    s->error = 0;
+    s->n_iov = 0;
+    s->wbuf_size = (size_t)max_chunk_size * 1024 + HEADER_ROOM;
+    s->wbuf = safe_malloc(s->wbuf_size);
+    s->wpos = 0;
+    s->chunk_iov = -1;
+    s->chunk_len = 0;
+    s->chunk_limit = first_chunk_size();
+    s->whole_body = 0;
+    s->body = NULL;
+    s->body_len = 0;
+    s->body_size = 0;
+    s->rpos = 0;
+    s->rlen = 0;
     return s;
 }
 
+// gather list
+
+static void add_iov(struct stream *s, const void *base, size_t len)
+{
+    struct iovec *last = s->n_iov > 0 ? &s->iov[s->n_iov - 1] : NULL;
+
+    if (last && (char *)last->iov_base + last->iov_len == base)
+    {
+        last->iov_len += len;
+        return;
+    }
+
+    s->iov[s->n_iov].iov_base = (void *)base;
+    s->iov[s->n_iov].iov_len = len;
+    s->n_iov++;
+}
+
+static void add_copy(struct stream *s, const char *text, size_t len)
+{
+    memcpy(s->wbuf + s->wpos, text, len);
+    add_iov(s, s->wbuf + s->wpos, len);
+    s->wpos += len;
+}
+
+// the size line is filled in by close_chunk()
+static void open_chunk(struct stream *s)
+{
+    s->iov[s->n_iov].iov_base = s->wbuf + s->wpos;
+    s->iov[s->n_iov].iov_len = 0;
+    s->chunk_iov = s->n_iov++;
+    s->chunk_len = 0;
+    s->wpos += CHUNK_HEADER_SIZE;
+}
+
+static void close_chunk(struct stream *s)
+{
+    if (s->chunk_iov < 0)
+        return;
+
+    struct iovec *header = &s->iov[s->chunk_iov];
+    if (s->chunk_len == 0)
+    {
+        // nothing was added after the size line
+        s->n_iov = s->chunk_iov;
+    }
+    else
+    {
+        char line[CHUNK_HEADER_SIZE + 1];
+        header->iov_len = snprintf(line, sizeof(line), "%zX\r\n", s->chunk_len);
+        memcpy(header->iov_base, line, header->iov_len);
+        add_iov(s, "\r\n", 2);
+    }
+    s->chunk_iov = -1;
+}
+
+static int send_segment(struct stream *s, int flags)
+{
+    close_chunk(s);
+
+    struct iovec *iov = s->iov;
+    int n = s->n_iov;
+
+    s->n_iov = 0;
+    s->wpos = 0;
+
+    while (n > 0 && !s->error)
+    {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t r = sendmsg(s->sd, &msg, flags);
+
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            struct pollfd pfd = { .fd = s->sd, .events = POLLOUT };
+            if ((errno == EAGAIN || errno == EWOULDBLOCK)
+                && poll(&pfd, 1, SEND_TIMEOUT_MS) > 0)
+                continue;
+
+            s->error = 1;
+            break;
+        }
+
+        while (n > 0 && (size_t)r >= iov->iov_len)
+        {
+            r -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+
+    return s->error ? -1 : 0;
+}
+
+/* a full chunk went out, let the next one grow */
+static void next_chunk(struct stream *s)
+{
+    send_segment(s, MSG_MORE);
+
+    size_t max = (size_t)max_chunk_size * 1024;
+    s->chunk_limit = s->chunk_limit * 2 < max ? s->chunk_limit * 2 : max;
+}
+
+/* make room for n_iov entries and wbuf_len copied bytes, the last
+ * entries are kept for the closing "\r\n" and "0\r\n\r\n" */
+static void reserve(struct stream *s, int n_iov, size_t wbuf_len)
+{
+    if (s->n_iov + n_iov + 2 > STREAM_MAX_IOV
+        || s->wpos + wbuf_len > s->wbuf_size)
+        send_segment(s, MSG_MORE);
+}
+
 // functions to write http chunks
 
-static void stream_clear(struct stream *s)
+static void chunk_add(struct stream *s, const char *text, size_t len, int copy);
+
+/* the held back body is too large, fall back to chunks */
+static void release_body(struct stream *s)
 {
-    if (s->pos <= 0)
+    char *body = s->body;
+    size_t body_len = s->body_len;
+
+    s->whole_body = 0;
+    s->body = NULL;
+    s->body_len = 0;
+    s->body_size = 0;
+
+    reserve(s, 1, 0);
+    add_iov(s, "Transfer-Encoding: chunked\r\n\r\n", 30);
+
+    if (body)
+    {
+        chunk_add(s, body, body_len, 0);
+        send_segment(s, MSG_MORE);
+        free(body);
+    }
+}
+
+static void body_add(struct stream *s, const char *text, size_t len)
+{
+    if (s->body_len + len > STREAM_MAX_BODY)
+    {
+        release_body(s);
+        chunk_add(s, text, len, 1);
         return;
+    }
+
+    if (s->body_len + len > s->body_size)
+    {
+        size_t size = s->body_size ? s->body_size : s->wbuf_size;
+        while (size < s->body_len + len)
+            size *= 2;
 
-    fprintf(s->fh, "%X\r\n", s->pos);
-    fwrite(s->buf, 1, s->pos, s->fh);
-    fputs("\r\n", s->fh);
-    s->pos = 0;
+        safe_realloc((void **)&s->body, size);
+        s->body_size = size;
+    }
+
+    memcpy(s->body + s->body_len, text, len);
+    s->body_len += len;
 }
 
-void chunk_printf(struct stream *s, const char *fmt, ...)
+static void chunk_add(struct stream *s, const char *text, size_t len, int copy)
 {
-    stream_clear(s);
+    if (s->whole_body)
+    {
+        body_add(s, text, len);
+        return;
+    }
+
+    copy = copy || len < MIN_STATIC_REF;
+
+    while (len > 0)
+    {
+        if (s->chunk_iov < 0)
+        {
+            if (s->wpos + CHUNK_HEADER_SIZE + (copy ? 1 : 0) > s->wbuf_size
+                || s->n_iov + 4 > STREAM_MAX_IOV)
+                send_segment(s, MSG_MORE);
+
+            open_chunk(s);
+        }
 
+        size_t room = s->chunk_limit - s->chunk_len;
+        if (copy && room > s->wbuf_size - s->wpos)
+            room = s->wbuf_size - s->wpos;
+
+        if (room == 0 || s->n_iov + 3 > STREAM_MAX_IOV)
+        {
+            next_chunk(s);
+            continue;
+        }
+
+        size_t n = len < room ? len : room;
+        if (copy)
+            add_copy(s, text, n);
+        else
+            add_iov(s, text, n);
+
+        s->chunk_len += n;
+        text += n;
+        len -= n;
+    }
+}
+
+void chunk_print_start(struct stream *s, int whole_body)
+{
+    s->chunk_limit = first_chunk_size();
+
+    if (whole_body)
+    {
+        s->whole_body = 1;
+        return;
+    }
+
+    reserve(s, 1, 0);
+    add_iov(s, "Transfer-Encoding: chunked\r\n\r\n", 30);
+}
+
+void chunk_printf(struct stream *s, const char *fmt, ...)
+{
+    char buf[BUFFER_SIZE];
     va_list va;
+
     va_start(va, fmt);
-    int bytes_written = vsnprintf(s->buf, BUFFER_SIZE, fmt, va);
+    int n = vsnprintf(buf, sizeof(buf), fmt, va);
     va_end(va);
 
-    if (bytes_written <= 0)
+    if (n <= 0)
         return;
 
-    fprintf(s->fh, "%X\r\n%s\r\n", bytes_written, s->buf);
+    if (n < (int)sizeof(buf))
+    {
+        chunk_add(s, buf, n, 1);
+        return;
+    }
+
+    char *big = safe_malloc(n + 1);
+    va_start(va, fmt);
+    vsnprintf(big, n + 1, fmt, va);
+    va_end(va);
+
+    chunk_add(s, big, n, 1);
+    free(big);
 }
 
 void chunk_print(struct stream *s, const char *text)
 {
-    while (*text != '\0')
-    {
-        if (s->pos == BUFFER_SIZE)
-            stream_clear(s);
-
-        s->buf[s->pos] = *text;
-        s->pos++;
-        text++;
-    }
+    chunk_add(s, text, strlen(text), 1);
 }
 
 void chunk_print_len(struct stream *s, const char *text, int len)
 {
-    while (*text != '\0' && len > 0)
-    {
-        if (s->pos == BUFFER_SIZE)
-            stream_clear(s);
+    chunk_add(s, text, strnlen(text, len), 1);
+}
 
-        s->buf[s->pos] = *text;
-        s->pos++;
-        text++;
-        len--;
-    }
+void chunk_print_static(struct stream *s, const char *text)
+{
+    chunk_add(s, text, strlen(text), 0);
 }
 
 void _chunk_print_all(struct stream *s, const char *first, ...)
@@ -121,46 +398,173 @@ void _chunk_print_all(struct stream *s, const char *first, ...)
     va_end(ap);
 }
 
+void _chunk_print_all_static(struct stream *s, const char *first, ...)
+{
+    va_list ap;
+
+    va_start(ap, first);
+    for (const char *arg = first; arg; arg = va_arg(ap, const char *))
+        chunk_print_static(s, arg);
+
+    va_end(ap);
+}
+
 int chunk_print_end(struct stream *s)
 {
-    stream_clear(s);
-    return fputs("0\r\n\r\n", s->fh);
+    if (s->whole_body)
+    {
+        s->whole_body = 0;
+        stream_printf(s, "Content-Length: %zu\r\n\r\n", s->body_len);
+
+        if (s->body_len > 0)
+            add_iov(s, s->body, s->body_len);
+
+        int r = send_segment(s, 0);
+
+        free(s->body);
+        s->body = NULL;
+        s->body_len = 0;
+        s->body_size = 0;
+        return r;
+    }
+
+    close_chunk(s);
+    reserve(s, 1, 0);
+    add_iov(s, "0\r\n\r\n", 5);
+    return send_segment(s, 0);
 }
 
 // standard io funcs
 
+static int stream_fill(struct stream *s)
+{
+    for (;;)
+    {
+        ssize_t n = recv(s->sd, s->rbuf, BUFFER_SIZE, 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+
+        s->rpos = 0;
+        s->rlen = n;
+        return 1;
+    }
+}
+
 size_t stream_read(void *ptr, size_t nitems, struct stream *s)
 {
-    return fread(ptr, 1, nitems, s->fh);
+    char *dst = ptr;
+    size_t done = 0;
+
+    while (done < nitems)
+    {
+        if (s->rpos == s->rlen && !stream_fill(s))
+            break;
+
+        size_t n = s->rlen - s->rpos;
+        if (n > nitems - done)
+            n = nitems - done;
+
+        memcpy(dst + done, s->rbuf + s->rpos, n);
+        s->rpos += n;
+        done += n;
+    }
+    return done;
+}
+
+int stream_wait_data(struct stream *s, int timeout_ms)
+{
+    if (s->rpos < s->rlen)
+        return 1;
+
+    struct pollfd pfd = { .fd = s->sd, .events = POLLIN };
+    int r = poll(&pfd, 1, timeout_ms);
+    if (r <= 0)
+        return r < 0 && errno != EINTR ? -1 : 0;
+
+    return stream_fill(s) ? 1 : -1;
 }
 
 size_t stream_write(const void *restrict ptr, size_t nitems, struct stream *s)
 {
-    return fwrite(ptr, 1, nitems, s->fh);
+    close_chunk(s);
+    reserve(s, 1, 0);
+    add_iov(s, ptr, nitems);
+
+    // ptr is only borrowed until we return
+    return send_segment(s, 0) == 0 ? nitems : 0;
+}
+
+int stream_flush(struct stream *s)
+{
+    // a HEAD response never ends its body
+    if (s->whole_body)
+        release_body(s);
+
+    return send_segment(s, 0);
+}
+
+int stream_flush_more(struct stream *s)
+{
+    return send_segment(s, MSG_MORE);
 }
 
 int stream_fileno(struct stream *s)
 {
-    return fileno(s->fh);
+    return s->sd;
 }
 
 int stream_printf(struct stream *s, const char *fmt, ...)
 {
     va_list va;
 
+    close_chunk(s);
+
     va_start(va, fmt);
+    int n = vsnprintf(s->wbuf + s->wpos, s->wbuf_size - s->wpos, fmt, va);
+    va_end(va);
 
-    int bytes_written = vfprintf(s->fh, fmt, va);
+    if (n < 0)
+        return n;
 
-    va_end(va);
+    if (s->wpos + n >= s->wbuf_size || s->n_iov + 3 > STREAM_MAX_IOV)
+    {
+        send_segment(s, MSG_MORE);
+
+        if (n >= s->wbuf_size)
+        {
+            char *big = safe_malloc(n + 1);
+            va_start(va, fmt);
+            vsnprintf(big, n + 1, fmt, va);
+            va_end(va);
 
-    return bytes_written;
+            add_iov(s, big, n);
+            send_segment(s, MSG_MORE);
+            free(big);
+            return n;
+        }
+
+        va_start(va, fmt);
+        vsnprintf(s->wbuf, s->wbuf_size, fmt, va);
+        va_end(va);
+    }
+
+    add_iov(s, s->wbuf + s->wpos, n);
+    s->wpos += n;
+    return n;
 }
 
 int sdclose(struct stream *s)
 {
-    stream_clear(s);
-    int r = fclose(s->fh);
+    int r = stream_flush(s);
+
+    if (close(s->sd) != 0)
+        r = -1;
+
+    free(s->body);
+    free(s->wbuf);
     free(s);
     return r;
 }
@@ -30,7 +30,13 @@
 
 #define BUFFER_SIZE 1024
 
-#include <stdio.h>
+// output gathered before a sendmsg(), see stream.c
+#define STREAM_MAX_IOV 64
+
+// largest body held back for a Content-Length response
+#define STREAM_MAX_BODY (1024 * 1024)
+
+#include <stddef.h>
 
 struct stream;
 
@@ -43,11 +49,24 @@ __attribute__((__format__(__printf__, 2, 3)));
 
 size_t stream_read(void *ptr, size_t nitems, struct stream *s);
 
+/* 1 once data is buffered, 0 on timeout, -1 on error or end of stream */
+int stream_wait_data(struct stream *s, int timeout_ms);
+
 size_t stream_write(const void *restrict ptr, size_t nitems, struct stream *st);
 
+int stream_flush(struct stream *s);
+
+/* flush, telling the kernel more data (eg. sendfile) follows */
+int stream_flush_more(struct stream *s);
+
 int stream_fileno(struct stream *s);
 
 /* send http chunks */
+
+/* end the headers, with whole_body the body is held back and sent with
+ * a Content-Length by chunk_print_end() unless it outgrows
+ * STREAM_MAX_BODY, otherwise it is sent chunked */
+void chunk_print_start(struct stream *f, int whole_body);
 void chunk_printf(struct stream *f, const char *fmt, ...)
 __attribute__((__format__(__printf__, 2, 3)));
 
@@ -55,8 +74,16 @@ void chunk_print_len(struct stream *s, const char *text, int len);
 
 void chunk_print(struct stream *f, const char *text);
 
+/* text is referenced, not copied, it must live until the next flush */
+void chunk_print_static(struct stream *f, const char *text);
+
 void _chunk_print_all(struct stream *f, const char *first, ...);
 
 #define CHUNK_PRINT_ALL(...) _chunk_print_all(__VA_ARGS__, (const char *)0);
 
+void _chunk_print_all_static(struct stream *f, const char *first, ...);
+
+#define CHUNK_PRINT_STATIC(...) _chunk_print_all_static(__VA_ARGS__, (const char *)0);
+
+/* terminate the body and send it, -1 on error */
 int chunk_print_end(struct stream *f);
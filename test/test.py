@@ -112,9 +112,10 @@ def xml_request(data=None, *, host=None, action="Browse"):
     return s
 
 
-def request(*, method, path):
+def request(*, method, path, extra_headers={}):
     headers = {
         "HOST": f"127.0.0.1:{port}",
+        **extra_headers,
     }
     s = http_client.send_request_head(
         domain="127.0.0.1",
@@ -343,12 +344,37 @@ class Test(unittest.TestCase):
         self.assertEqual(r.status_code, 200)
         self.assertIn("GetProtocolInfoResponse", r.read_body())
 
+    def test_get_system_update_id(self):
+        s = xml_request("", action="GetSystemUpdateID")
+        r = s.read_http_response()
+        self.assertEqual(r.status_code, 200)
+        self.assertIn("<Id>0</Id>", r.read_body())
+
     def test_get_request(self):
         r = request(method="GET", path="/MediaItems/11.mkv")
         self.assertEqual(r.status_code, 200)
         self.assertIn("dummy", r.read_body())
         self.assertEqual(r.headers["Content-Type"], "video/x-matroska")
 
+    def test_suffix_range_request(self):
+        r = request(method="GET", path="/MediaItems/11.mkv",
+                    extra_headers={"Range": "bytes=-3"})
+        self.assertEqual(r.status_code, 206)
+        self.assertEqual(r.headers["Content-Range"], "bytes 3-5/6")
+        self.assertEqual(r.read_body(), "my\n")
+
+    def test_multi_range_request(self):
+        r = request(method="GET", path="/MediaItems/11.mkv",
+                    extra_headers={"Range": "bytes=0-1,4-"})
+        self.assertEqual(r.status_code, 206)
+        content_type, _, boundary = r.headers["Content-Type"].partition("; boundary=")
+        self.assertEqual(content_type, "multipart/byteranges")
+        parts = r.read_body().split(f"\r\n--{boundary}")
+        self.assertEqual(parts[0], "")
+        self.assertEqual(parts[-1], "--\r\n")
+        self.assertTrue(parts[1].endswith("Content-Range: bytes 0-1/6\r\n\r\ndu"))
+        self.assertTrue(parts[2].endswith("Content-Range: bytes 4-5/6\r\n\r\ny\n"))
+
     def test_prohibited_get_request(self):
         r = request(method="GET", path="/MediaItems/01")
         self.assertEqual(r.status_code, 406)
@@ -36,14 +36,14 @@ class abstract_http_message:
 
     def read_body(self):
         if self.length > 0:
-            body = self.s.recv(self.length).decode()
+            body = self.recv_exact(self.length).decode()
         elif self.chunked:
             chunks = []
             while True:
                 line = self.readline()
                 size = int(line, 16)
-                chunks.append(self.s.recv(size))
-                assert self.s.recv(2) == b"\r\n"
+                chunks.append(self.recv_exact(size))
+                assert self.recv_exact(2) == b"\r\n"
                 if size == 0:
                     break
             body = b"".join(chunks).decode()
@@ -56,6 +56,17 @@ class abstract_http_message:
     def close(self):
         self.s.close()
 
+    def recv_exact(self, n):
+        # a response may be split across any number of segments
+        data = []
+        while n > 0:
+            c = self.s.recv(n)
+            if c == b"":
+                break
+            data.append(c)
+            n -= len(c)
+        return b"".join(data)
+
     def readline(self):
         line = []
         while True:
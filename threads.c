@@ -26,53 +26,94 @@
 #include "threads.h"
 #include "globalvars.h"
 #include "log.h"
+#include "utils.h"
 
-static int active_threads = 0;
+/* a fixed pool of max_connections workers takes jobs from a bounded
+ * ring, queue_depth jobs may wait for a free worker */
+struct work_item
+{
+    void (*fn)(void *);
+    void *arg;
+};
+
+static struct work_item *queue = NULL;
+static int queue_head = 0;
+static int queue_len = 0;
+static int idle_workers = 0;
 
 static pthread_mutex_t lock;
-static pthread_attr_t thread_attrs;
+static pthread_cond_t work_ready;
 
-void decrement_thread_count(void)
+static void *worker_thread(void *unused)
 {
-    pthread_mutex_lock(&lock);
-    active_threads--;
-    PRINT_LOG(E_DEBUG, "ending thread: total threads: %d\n", active_threads);
-    pthread_mutex_unlock(&lock);
+    for (;;)
+    {
+        pthread_mutex_lock(&lock);
+
+        idle_workers++;
+        while (queue_len == 0)
+            pthread_cond_wait(&work_ready, &lock);
+        idle_workers--;
+
+        struct work_item item = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_depth;
+        queue_len--;
+
+        pthread_mutex_unlock(&lock);
+
+        item.fn(item.arg);
+    }
+    return NULL;
 }
 
-int create_thread(void *(*start_routine)(void *), void *arg)
+int queue_work(void (*fn)(void *), void *arg)
 {
     pthread_mutex_lock(&lock);
 
-    if (active_threads >= max_connections)
+    if (queue_len >= queue_depth)
     {
-        PRINT_LOG(E_ERROR, "Exceeded max connections [%d], not threading\n",
-                  max_connections);
+        PRINT_LOG(E_ERROR, "Work queue full [%d], rejecting\n", queue_depth);
         pthread_mutex_unlock(&lock);
         return -1;
     }
 
-    pthread_t thr;
-    int r = pthread_create(&thr, &thread_attrs, start_routine, arg);
-    if (r == 0)
-    {
-        active_threads++;
-        PRINT_LOG(E_DEBUG, "creating thread: total threads: %d\n", active_threads);
-    }
-    else
-    {
-        PRINT_LOG(E_ERROR, "pthread_create failed: %d\n", r);
-        r = -1;
-    }
+    queue[(queue_head + queue_len) % queue_depth] = (struct work_item) { fn, arg };
+    queue_len++;
+    PRINT_LOG(E_DEBUG, "queued work: waiting %d, idle workers %d\n", queue_len, idle_workers);
+
+    pthread_cond_signal(&work_ready);
+    pthread_mutex_unlock(&lock);
 
+    return 0;
+}
+
+int pending_work(void)
+{
+    pthread_mutex_lock(&lock);
+    int waiting = queue_len;
     pthread_mutex_unlock(&lock);
 
-    return r;
+    return waiting;
 }
 
 void init_threads(void)
 {
     pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&work_ready, NULL);
+
+    queue = safe_malloc(queue_depth * sizeof(struct work_item));
+
+    pthread_attr_t thread_attrs;
     pthread_attr_init(&thread_attrs);
     pthread_attr_setdetachstate(&thread_attrs, PTHREAD_CREATE_DETACHED);
+
+    for (int i = 0; i < max_connections; i++)
+    {
+        pthread_t thr;
+        int r = pthread_create(&thr, &thread_attrs, worker_thread, NULL);
+        if (r != 0)
+            EXIT_ERROR("Failed to start worker thread: %d\n", r);
+    }
+
+    pthread_attr_destroy(&thread_attrs);
 }
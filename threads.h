@@ -28,8 +28,10 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-void decrement_thread_count(void);
+/* hand a job to the worker pool, -1 if the queue is full */
+int queue_work(void (*fn)(void *), void *arg);
 
-int create_thread(void *(*start_routine)(void *), void *arg);
+/* number of jobs waiting for a free worker */
+int pending_work(void);
 
 void init_threads(void);
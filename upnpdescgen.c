@@ -40,6 +40,7 @@
 #include "globalvars.h"
 #include "utils.h"
 #include "getifaddr.h"
+#include "mediawatch.h"
 #include "stream.h"
 #include "upnpdescgen.h"
 #include "microdlnapath.h"
@@ -222,6 +223,20 @@ static const struct argument browse_args[] = {
     { NULL, 0, 0 }
 };
 
+static const struct argument search_args[] = {
+    { "ContainerID", 1, 1 },    // A_ARG_TYPE_ObjectID
+    { "SearchCriteria", 1, 13 },    // A_ARG_TYPE_SearchCriteria
+    { "Filter", 1, 10 },        // A_ARG_TYPE_Filter
+    { "StartingIndex", 1, 4 },  // A_ARG_TYPE_Index
+    { "RequestedCount", 1, 5 }, // A_ARG_TYPE_Count
+    { "SortCriteria", 1, 11 },  // A_ARG_TYPE_SortCriteria
+    { "Result", 2, 2 },         // A_ARG_TYPE_Result
+    { "NumberReturned", 2, 5 }, // A_ARG_TYPE_Count
+    { "TotalMatches", 2, 5 },   // A_ARG_TYPE_Count
+    { "UpdateID", 2, 6 },       // A_ARG_TYPE_UpdateID
+    { NULL, 0, 0 }
+};
+
 static const struct action content_directory_actions[] = {
     { "GetSearchCapabilities", get_search_capabilities_args },  /* R */
     { "GetSortCapabilities", get_sort_capabilities_args },  /* R */
@@ -230,6 +245,16 @@ static const struct action content_directory_actions[] = {
     { NULL, 0 }
 };
 
+/* advertised when search is enabled */
+static const struct action content_directory_search_actions[] = {
+    { "GetSearchCapabilities", get_search_capabilities_args },  /* R */
+    { "GetSortCapabilities", get_sort_capabilities_args },  /* R */
+    { "GetSystemUpdateID", get_system_update_id_args }, /* R */
+    { "Browse", browse_args },  /* R */
+    { "Search", search_args },  /* O */
+    { NULL, 0 }
+};
+
 static const struct state_var content_directory_vars[] = {
     { "TransferIDs", EVENTED, 0 },
     { "A_ARG_TYPE_ObjectID", 0, 0 },
@@ -243,6 +268,8 @@ static const struct state_var content_directory_vars[] = {
     { "SystemUpdateID", 1 | EVENTED, 0 },
     { "A_ARG_TYPE_Filter", 0, 0 },
     { "A_ARG_TYPE_SortCriteria", 0, 0 },
+    { "ContainerUpdateIDs", EVENTED, 0 },
+    { "A_ARG_TYPE_SearchCriteria", 0, 0 },
     { NULL, 0, 0 }
 };
 
@@ -414,67 +441,68 @@ void gen_root_desc(struct stream *st)
 static void gen_service_desc(struct stream *st, const struct action *acts,
                              const struct state_var *vars)
 {
-    CHUNK_PRINT_ALL(st, xmlver, "<", root_service,
-                    "><specVersion><major>1</major><minor>0</minor></specVersion><actionList>");
+    CHUNK_PRINT_STATIC(st, xmlver, "<", root_service,
+                       "><specVersion><major>1</major><minor>0</minor></specVersion><actionList>");
 
     for (int i = 0; acts[i].name; i++)
     {
-        CHUNK_PRINT_ALL(st, "<action><name>", acts[i].name, "</name>");
+        CHUNK_PRINT_STATIC(st, "<action><name>", acts[i].name, "</name>");
 
         /* argument List */
         const struct argument *args = acts[i].args;
         if (args)
         {
-            chunk_print(st, "<argumentList>");
+            chunk_print_static(st, "<argumentList>");
 
             for (int j = 0; args[j].dir; j++)
             {
                 const char *p = vars[args[j].related_var].name;
 
-                CHUNK_PRINT_ALL(st, "<argument><name>",
-                                args[j].name ? args[j].name : p,
-                                "</name><direction>",
-                                args[j].dir == 1 ? "in" : "out",
-                                "</direction><relatedStateVariable>",
-                                p, "</relatedStateVariable></argument>");
+                CHUNK_PRINT_STATIC(st, "<argument><name>",
+                                   args[j].name ? args[j].name : p,
+                                   "</name><direction>",
+                                   args[j].dir == 1 ? "in" : "out",
+                                   "</direction><relatedStateVariable>",
+                                   p, "</relatedStateVariable></argument>");
             }
 
-            chunk_print(st, "</argumentList>");
+            chunk_print_static(st, "</argumentList>");
         }
-        chunk_print(st, "</action>");
+        chunk_print_static(st, "</action>");
     }
-    chunk_print(st, "</actionList><serviceStateTable>");
+    chunk_print_static(st, "</actionList><serviceStateTable>");
 
     for (int i = 0; vars[i].name; i++)
     {
-        CHUNK_PRINT_ALL(st, "<stateVariable sendEvents=\"",
-                        vars[i].itype & EVENTED ? "yes" : "no",
-                        "\"><name>",
-                        vars[i].name,
-                        "</name><dataType>",
-                        upnptypes[vars[i].itype & 0x0f], "</dataType>");
+        CHUNK_PRINT_STATIC(st, "<stateVariable sendEvents=\"",
+                           vars[i].itype & EVENTED ? "yes" : "no",
+                           "\"><name>",
+                           vars[i].name,
+                           "</name><dataType>",
+                           upnptypes[vars[i].itype & 0x0f], "</dataType>");
 
         if (vars[i].iallowedlist)
         {
-            chunk_print(st, "<allowedValueList>");
+            chunk_print_static(st, "<allowedValueList>");
             for (int j = vars[i].iallowedlist; upnpallowedvalues[j]; j++)
             {
-                CHUNK_PRINT_ALL(st, "<allowedValue>",
-                                upnpallowedvalues[j], "</allowedValue>");
+                CHUNK_PRINT_STATIC(st, "<allowedValue>",
+                                   upnpallowedvalues[j], "</allowedValue>");
             }
-            chunk_print(st, "</allowedValueList>");
+            chunk_print_static(st, "</allowedValueList>");
         }
-        chunk_print(st, "</stateVariable>");
+        chunk_print_static(st, "</stateVariable>");
     }
 
-    chunk_print(st, "</serviceStateTable></scpd>");
+    chunk_print_static(st, "</serviceStateTable></scpd>");
 }
 
 /* sendContentDirectory() :
  * Generate the ContentDirectory xml description */
 void send_content_directory(struct stream *st)
 {
-    gen_service_desc(st, content_directory_actions, content_directory_vars);
+    gen_service_desc(st, enable_search ? content_directory_search_actions
+                     : content_directory_actions, content_directory_vars);
 }
 
 /* sendConnectionManager() :
@@ -492,15 +520,22 @@ void send_x_ms_media_receiver_registrar(struct stream *st)
                      x_ms_media_receiver_registrar_vars);
 }
 
+static void get_system_update_id_value(struct stream *fh)
+{
+    chunk_printf(fh, "%u", mediawatch_system_update_id());
+}
+
 void get_vars_content_directory(struct stream *fh)
 {
     const struct xml_elt data[] = {
         { .name = "e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\" "
-                  "xmlns:s=\"urn:schemas-upnp-org:service:ContentDirectory:1\"", .children = 2 },
+                  "xmlns:s=\"urn:schemas-upnp-org:service:ContentDirectory:1\"", .children = 3 },
         { .name = "e:property", .children = 1 },
         { .name = "TransferIDs", .children = 0 },
         { .name = "e:property", .children = 1 },
-        { .name = "/SystemUpdateID", .value = "0" },
+        { .name = "@SystemUpdateID", .callback = get_system_update_id_value },
+        { .name = "e:property", .children = 1 },
+        { .name = "@ContainerUpdateIDs", .callback = mediawatch_print_container_update_ids },
         { NULL, NULL },
     };
 
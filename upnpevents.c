@@ -51,17 +51,17 @@
  */
 #include <arpa/inet.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "event.h"
 #include "stream.h"
 #include "upnpevents.h"
 #include "log.h"
@@ -92,6 +92,7 @@ struct subscriber
     struct upnp_event_notify *notify;
     time_t timeout;
     uint32_t seq;
+    int pending;                /* changed while a notify was in flight */
     enum SubscriberServiceEnum service;
     char uuid[42];
     char callback[];
@@ -99,8 +100,9 @@ struct subscriber
 
 struct upnp_event_notify
 {
+    struct event_handler ev;    /* must be first, ev.fd is the socket */
     struct upnp_event_notify *next;
-    int s;                      /* socket */
+    struct upnp_event_notify *prev;
     enum
     { ECreated = 1,
       EConnecting,
@@ -118,6 +120,9 @@ struct upnp_event_notify
 
 /* prototype */
 static void upnp_event_create_notify(struct subscriber *sub);
+static void upnp_event_notify_connect(struct upnp_event_notify *obj);
+static void upnp_event_process_notify(struct event_handler *ev, int events);
+static void upnpevents_removed_timedout_subs(struct event_handler *ev, int events);
 
 /* subscriber list */
 static struct subscriber *subscriberlist = NULL;
@@ -125,6 +130,21 @@ static struct subscriber *subscriberlist = NULL;
 /* notify list */
 static struct upnp_event_notify *notifylist = NULL;
 
+/* both lists are shared between the main loop and the http worker threads */
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* seconds between sweeps for expired subscriptions */
+#define SUBSCRIBER_EXPIRY_INTERVAL 30
+
+static struct event_handler expiry_timer;
+
+void init_upnpevents(void)
+{
+    expiry_timer.process = upnpevents_removed_timedout_subs;
+    if (event_add_timer(&expiry_timer, SUBSCRIBER_EXPIRY_INTERVAL) < 0)
+        EXIT_ERROR("Failed to create subscriber expiry timer\n");
+}
+
 /* creates a new subscriber and adds it to the subscriber list
  * also initiate 1st notify */
 static char *add_upnpevent_subscriber(const char *eventurl, const char *callback,
@@ -214,54 +234,84 @@ static int remove_upnpevent_subscriber(const char *sid)
 
 void clear_upnpevent_subscribers(void)
 {
+    pthread_mutex_lock(&events_lock);
+
     struct subscriber *sub = subscriberlist;
     struct subscriber *next;
 
     while (sub != NULL)
     {
         next = sub->next;
+        if (sub->notify)
+            sub->notify->sub = NULL;
         free(sub);
         sub = next;
     }
     subscriberlist = NULL;
+
+    pthread_mutex_unlock(&events_lock);
 }
 
 /* create and add the notify object to the list */
+/* create the notify object, start connecting and add it to the list */
 static void upnp_event_create_notify(struct subscriber *sub)
 {
     struct upnp_event_notify *obj;
-    int flags;
 
     obj = safe_malloc(sizeof(struct upnp_event_notify));
+    memset(obj, 0, sizeof(struct upnp_event_notify));
 
     obj->sub = sub;
     obj->state = ECreated;
-    obj->s = socket(PF_INET, SOCK_STREAM, 0);
-    if (obj->s < 0)
+    obj->ev.process = upnp_event_process_notify;
+    obj->ev.fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (obj->ev.fd < 0)
     {
         PRINT_LOG(E_ERROR, "upnp_event_create_notify: socket(): %d\n", errno);
         goto error;
     }
-    if ((flags = fcntl(obj->s, F_GETFL, 0)) < 0)
-    {
-        PRINT_LOG(E_ERROR, "upnp_event_create_notify: fcntl(..F_GETFL..): %d\n", errno);
+    if (set_non_blocking(obj->ev.fd, 1) < 0)
         goto error;
-    }
-    if (fcntl(obj->s, F_SETFL, flags | O_NONBLOCK) < 0)
-    {
-        PRINT_LOG(E_ERROR, "upnp_event_create_notify: fcntl(..F_SETFL..): %d\n", errno);
+
+    upnp_event_notify_connect(obj);
+    if (obj->state != EConnecting)
         goto error;
-    }
+
+    if (event_add(&obj->ev, EVENT_WRITE) < 0)
+        goto error;
+
     if (sub)
         sub->notify = obj;
 
+    obj->prev = NULL;
     obj->next = notifylist;
+    if (notifylist)
+        notifylist->prev = obj;
     notifylist = obj;
 
     return;
 error:
-    if (obj->s >= 0)
-        close(obj->s);
+    if (obj->ev.fd >= 0)
+        close(obj->ev.fd);
+    free(obj);
+}
+
+/* unlink, close and free a finished notify */
+static void upnp_event_free_notify(struct upnp_event_notify *obj)
+{
+    event_del(&obj->ev);
+    close(obj->ev.fd);
+
+    if (obj->sub)
+        obj->sub->notify = NULL;
+
+    if (obj->prev)
+        obj->prev->next = obj->next;
+    else
+        notifylist = obj->next;
+    if (obj->next)
+        obj->next->prev = obj->prev;
+
     free(obj);
 }
 
@@ -313,7 +363,7 @@ static void upnp_event_notify_connect(struct upnp_event_notify *obj)
     PRINT_LOG(E_DEBUG, "%s: '%s' %hu '%s'\n", "upnp_event_notify_connect",
               obj->addrstr, lport, obj->path);
     obj->state = EConnecting;
-    if (connect(obj->s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    if (connect(obj->ev.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
     {
         if (errno != EINPROGRESS && errno != EWOULDBLOCK)
         {
@@ -325,16 +375,17 @@ static void upnp_event_notify_connect(struct upnp_event_notify *obj)
 
 static void upnp_event_prepare(struct upnp_event_notify *obj)
 {
-    if (obj->sub == NULL || obj->s == -1)
+    if (obj->sub == NULL || obj->ev.fd == -1)
     {
         obj->state = EError;
         return;
     }
 
-    int nfd = dup(obj->s);
+    int nfd = dup(obj->ev.fd);
     if (nfd == -1)
     {
         perror("dup failed");
+        obj->state = EError;
         return;
     }
 
@@ -342,6 +393,8 @@ static void upnp_event_prepare(struct upnp_event_notify *obj)
     if (!fh)
     {
         PRINT_LOG(E_DEBUG, "Failed to reopen filehandle\n");
+        close(nfd);
+        obj->state = EError;
         return;
     }
 
@@ -377,7 +430,7 @@ static void upnp_event_prepare(struct upnp_event_notify *obj)
     int r = chunk_print_end(fh);
     sdclose(fh);
 
-    if (r == EOF)
+    if (r < 0)
         obj->state = EError;
     else
         obj->state = EWaitingForResponse;
@@ -386,7 +439,7 @@ static void upnp_event_prepare(struct upnp_event_notify *obj)
 static void upnp_event_recv(struct upnp_event_notify *obj)
 {
     // receive a message but ignore it!
-    int n = recv(obj->s, NULL, 0, MSG_TRUNC);
+    int n = recv(obj->ev.fd, NULL, 0, MSG_TRUNC);
 
     if (n < 0)
     {
@@ -404,107 +457,79 @@ static void upnp_event_recv(struct upnp_event_notify *obj)
     }
 }
 
-static void upnp_event_process_notify(struct upnp_event_notify *obj)
+/* event handler, runs on the main loop */
+static void upnp_event_process_notify(struct event_handler *ev, int events)
 {
+    struct upnp_event_notify *obj = (struct upnp_event_notify *)ev;
+
+    pthread_mutex_lock(&events_lock);
+
+    PRINT_LOG(E_DEBUG, "upnp_event_process_notify: %p %d %d %d\n",
+              obj, obj->state, obj->ev.fd, events);
+
     switch (obj->state)
     {
     case EConnecting:
         /* now connected or failed to connect */
-        upnp_event_prepare(obj);
+        if (events & EVENT_WRITE)
+        {
+            upnp_event_prepare(obj);
+            if (obj->state == EWaitingForResponse && event_mod(&obj->ev, EVENT_READ) < 0)
+                obj->state = EError;
+        }
         break;
 
     case EWaitingForResponse:
-        upnp_event_recv(obj);
-        break;
-
-    case EFinished:
-        close(obj->s);
-        obj->s = -1;
+        if (events & EVENT_READ)
+            upnp_event_recv(obj);
         break;
 
     default:
         PRINT_LOG(E_ERROR, "upnp_event_process_notify: unknown state\n");
+        obj->state = EError;
     }
-}
 
-void upnpevents_selectfds(fd_set *readset, fd_set *writeset, int *max_fd)
-{
-    struct upnp_event_notify *obj;
-
-    for (obj = notifylist; obj != NULL; obj = obj->next)
+    if (obj->state == EError || obj->state == EFinished)
     {
-        PRINT_LOG(E_DEBUG, "upnpevents_selectfds: %p %d %d\n", obj, obj->state, obj->s);
-        if (obj->s >= 0)
-        {
-            switch (obj->state)
-            {
-            case ECreated:
-                upnp_event_notify_connect(obj);
-                if (obj->state != EConnecting)
-                    break;
-
-            case EConnecting:
-            case ESending:
-                FD_SET(obj->s, writeset);
-                if (obj->s > *max_fd)
-                    *max_fd = obj->s;
-                break;
-
-            case EWaitingForResponse:
-                FD_SET(obj->s, readset);
-                if (obj->s > *max_fd)
-                    *max_fd = obj->s;
-                break;
-
-            default:
-                break;
-            }
-        }
+        struct subscriber *sub = obj->sub;
+        int resend = obj->state == EFinished && sub && sub->pending;
+
+        upnp_event_free_notify(obj);
+
+        if (sub)
+            sub->pending = 0;
+        if (resend)
+            upnp_event_create_notify(sub);
     }
+
+    pthread_mutex_unlock(&events_lock);
 }
 
-void upnpevents_processfds(fd_set *readset, fd_set *writeset)
+/* send the new ContentDirectory state to every subscriber, one notify
+ * at a time per subscriber so events arrive in SEQ order */
+void upnpevents_content_directory_changed(void)
 {
-    struct upnp_event_notify *obj;
+    pthread_mutex_lock(&events_lock);
 
-    for (obj = notifylist; obj != NULL; obj = obj->next)
-    {
-        PRINT_LOG(E_DEBUG, "upnpevents_processfds: %p %d %d %d %d\n",
-                  obj, obj->state, obj->s,
-                  FD_ISSET(obj->s, readset), FD_ISSET(obj->s, writeset));
-
-        if (obj->s >= 0)
-        {
-            if (FD_ISSET(obj->s, readset) || FD_ISSET(obj->s, writeset))
-                upnp_event_process_notify(obj);
-        }
-    }
-
-    for (struct upnp_event_notify ** cur = &notifylist; *cur != NULL;)
+    for (struct subscriber * sub = subscriberlist; sub != NULL; sub = sub->next)
     {
-        obj = *cur;
+        if (sub->service != EContentDirectory)
+            continue;
 
-        if (obj->state == EError || obj->state == EFinished)
-        {
-            if (obj->s >= 0)
-            {
-                close(obj->s);
-            }
-            if (obj->sub)
-                obj->sub->notify = NULL;
-
-            *cur = obj->next;
-            free(obj);
-        }
+        if (sub->notify)
+            sub->pending = 1;
         else
-        {
-            cur = &(obj->next);
-        }
+            upnp_event_create_notify(sub);
     }
+
+    pthread_mutex_unlock(&events_lock);
 }
 
-void upnpevents_removed_timedout_subs(void)
+/* timer handler, removes timeouted subscribers */
+static void upnpevents_removed_timedout_subs(struct event_handler *ev, int events)
 {
+    pthread_mutex_lock(&events_lock);
+
     /* remove timeouted subscribers */
     time_t curtime = time(NULL);
     struct subscriber *sub;
@@ -524,24 +549,18 @@ void upnpevents_removed_timedout_subs(void)
             cur = &(sub->next);
         }
     }
+
+    pthread_mutex_unlock(&events_lock);
 }
 
 void upnpevents_clear_notify_list(void)
 {
-    struct upnp_event_notify *obj = notifylist;
-
-    while (obj != NULL)
-    {
-        struct upnp_event_notify *next = obj->next;
-
-        if (obj->s >= 0)
-            close(obj->s);
+    pthread_mutex_lock(&events_lock);
 
-        free(obj);
-        obj = next;
-    }
+    while (notifylist != NULL)
+        upnp_event_free_notify(notifylist);
 
-    notifylist = NULL;
+    pthread_mutex_unlock(&events_lock);
 }
 
 static int check_event(struct upnphttp *h)
@@ -590,6 +609,7 @@ static int check_event(struct upnphttp *h)
 void process_http_subscribe_upnphttp(struct upnphttp *h)
 {
     char *sid;
+    int r;
 
     PRINT_LOG(E_DEBUG, "ProcessHTTPSubscribe %s\n", h->path);
     PRINT_LOG(E_DEBUG, "Callback '%s' Timeout=%d\n", h->req_callback, h->req_timeout);
@@ -602,6 +622,7 @@ void process_http_subscribe_upnphttp(struct upnphttp *h)
          * - respond HTTP/x.x 200 OK
          * - Send the initial event message */
         /* Server:, SID:; Timeout: Second-(xx|infinite) */
+        pthread_mutex_lock(&events_lock);
         sid = add_upnpevent_subscriber(h->path, h->req_callback, h->req_timeout);
         h->respflags = FLAG_TIMEOUT;
         if (sid)
@@ -611,12 +632,18 @@ void process_http_subscribe_upnphttp(struct upnphttp *h)
             free(h->req_sid);
             h->req_sid = safe_strdup(sid);
         }
+        pthread_mutex_unlock(&events_lock);
+
         send_http_response(h, HTTP_OK_200);
         break;
 
     case E_RENEW:
         /* subscription renew */
-        if (renew_upnpevent_subscriber(h->req_sid, h->req_timeout) < 0)
+        pthread_mutex_lock(&events_lock);
+        r = renew_upnpevent_subscriber(h->req_sid, h->req_timeout);
+        pthread_mutex_unlock(&events_lock);
+
+        if (r < 0)
         {
             /* Invalid SID
                412 Precondition Failed. If a SID does not correspond to a known,
@@ -647,7 +674,11 @@ void process_http_un_subscribe_upnphttp(struct upnphttp *h)
     /* Remove from the list */
     if (check_event(h) != E_INVALID)
     {
-        if (remove_upnpevent_subscriber(h->req_sid) < 0)
+        pthread_mutex_lock(&events_lock);
+        int r = remove_upnpevent_subscriber(h->req_sid);
+        pthread_mutex_unlock(&events_lock);
+
+        if (r < 0)
             send_http_response(h, HTTP_PRECONDITION_FAILED_412);
         else
             send_http_response(h, HTTP_OK_200);
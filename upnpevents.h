@@ -53,16 +53,14 @@
 
 struct upnphttp;
 
-void clear_upnpevent_subscribers(void);
-
-void upnpevents_selectfds(fd_set *readset, fd_set *writeset, int *max_fd);
-
-void upnpevents_processfds(fd_set *readset, fd_set *writeset);
+void init_upnpevents(void);
 
-void upnpevents_removed_timedout_subs(void);
+void clear_upnpevent_subscribers(void);
 
 void upnpevents_clear_notify_list(void);
 
+void upnpevents_content_directory_changed(void);
+
 void process_http_subscribe_upnphttp(struct upnphttp *h);
 
 void process_http_un_subscribe_upnphttp(struct upnphttp *h);
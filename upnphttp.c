@@ -68,6 +68,7 @@
 #include <unistd.h>
 
 #include "stream.h"
+#include "filecache.h"
 #include "getifaddr.h"
 #include "globalvars.h"
 #include "icons.h"
@@ -84,14 +85,23 @@
 #include "xmlregex.h"
 #include "mediadir.h"
 
+// multipart/byteranges boundary, 16 random hex digits
+#define BOUNDARY_LEN 16
+
 #define DLNA_FLAG_DLNA_V1_5      0x00100000 // dlnaVersion15Supported
 #define DLNA_FLAG_HTTP_STALLING  0x00200000 // connectionStallingSupported
 #define DLNA_FLAG_TM_B           0x00400000 // backgroundTransferModeSupported
 #define DLNA_FLAG_TM_I           0x00800000 // interactiveTransferModeSupported
 #define DLNA_FLAG_TM_S           0x01000000 // streamingTransferModeSupported
 
+#define RETRY_AFTER_SECONDS 2   // suggested back off when the worker queue is full
+
+#define KEEP_ALIVE_TIMEOUT 10   // seconds an idle kept-alive connection holds a worker
+#define KEEP_ALIVE_MAX_REQUESTS 100
+
 static void send_resp_icon(struct upnphttp *);
 static void send_resp_dlnafile(struct upnphttp *);
+static int process_upnphttp_http_query(struct upnphttp *h);
 
 static struct upnphttp *init_upnphttp_struct(int s, int iface)
 {
@@ -114,6 +124,33 @@ static struct upnphttp *init_upnphttp_struct(int s, int iface)
     return ret;
 }
 
+static void free_upnphttp_request(struct upnphttp *h)
+{
+    free(h->remote_dirpath);
+    free(h->search_criteria);
+    free(h->req_callback);
+    free(h->req_sid);
+    free(h->req_nt);
+    free(h->path);
+}
+
+/* clear the request state before reading the next request on a
+ * kept-alive connection */
+static void reset_upnphttp_struct(struct upnphttp *h)
+{
+    struct stream *st = h->st;
+    int iface = h->iface;
+    int requests = h->requests;
+
+    free_upnphttp_request(h);
+    memset(h, 0, sizeof(struct upnphttp));
+
+    h->st = st;
+    h->iface = iface;
+    h->requests = requests;
+    h->requested_count = -1;
+}
+
 static void delete_upnphttp_struct(struct upnphttp *h)
 {
     if (!h)
@@ -122,15 +159,68 @@ static void delete_upnphttp_struct(struct upnphttp *h)
     if (h->st && sdclose(h->st) < 0)
         PRINT_LOG(E_ERROR, "delete_upnphttp_struct: fclose(%d): %d\n", stream_fileno(h->st), errno);
 
-    free(h->remote_dirpath);
-    free(h->req_callback);
-    free(h->req_sid);
-    free(h->req_nt);
-    free(h->path);
+    free_upnphttp_request(h);
     free(h);
 }
 
 
+/* parse the comma separated ranges of a Range header, 0 if malformed */
+static int parse_byte_ranges(struct upnphttp *h, const char *value)
+{
+    h->n_ranges = 0;
+
+    for (;;)
+    {
+        struct byte_range r;
+        char *end;
+
+        while (*value == ' ' || *value == '\t')
+            value++;
+
+        if (*value == '-')
+        {
+            r.start = -1;
+            r.end = strtoll(value + 1, &end, 10);
+            if (end == value + 1 || r.end < 0)
+                return 0;
+        }
+        else
+        {
+            r.start = strtoll(value, &end, 10);
+            if (end == value || r.start < 0 || *end != '-')
+                return 0;
+
+            value = end + 1;
+            if (*value >= '0' && *value <= '9')
+            {
+                r.end = strtoll(value, &end, 10);
+                if (r.end < r.start)
+                    return 0;
+            }
+            else
+            {
+                r.end = -1;
+                end = (char *)value;
+            }
+        }
+
+        // too many pieces, the whole file is served instead
+        if (h->n_ranges < MAX_RANGES)
+            h->req_ranges[h->n_ranges++] = r;
+        else
+            h->reqflags |= FLAG_MANY_RANGES;
+
+        value = end;
+        while (*value == ' ' || *value == '\t')
+            value++;
+
+        if (*value == '\0')
+            return 1;
+        if (*value++ != ',')
+            return 0;
+    }
+}
+
 /* parse HttpHeaders of the REQUEST */
 static void parse_http_header(struct upnphttp *h, char *name, char *value, int len)
 {
@@ -157,11 +247,14 @@ static void parse_http_header(struct upnphttp *h, char *name, char *value, int l
         if (strcmp("Browse", value) == 0)
             h->req_soap_action = browse_content_directory;
         else if (strcmp("Search", value) == 0)
-            h->req_soap_action = unsupported_soap_action;
+            h->req_soap_action = enable_search ? search_content_directory
+                : unsupported_soap_action;
         else if (strcmp("GetSearchCapabilities", value) == 0)
             h->req_soap_action = get_search_capabilities;
         else if (strcmp("GetSortCapabilities", value) == 0)
             h->req_soap_action = get_sort_capabilities;
+        else if (strcmp("GetSystemUpdateID", value) == 0)
+            h->req_soap_action = get_system_update_id;
         else if (strcmp("GetProtocolInfo", value) == 0)
             h->req_soap_action = get_protocol_info;
         else
@@ -199,20 +292,14 @@ static void parse_http_header(struct upnphttp *h, char *name, char *value, int l
         if (strncasecmp(value, "Second-", 7) == 0)
             h->req_timeout = atoi(value + 7);
     }
-    // Range: bytes=xxx-yyy
+    // Range: bytes=xxx-yyy,-zzz,...
     else if (strncasecmp(name, "Range", 5) == 0)
     {
         if (strncasecmp(value, "bytes=", 6) == 0)
         {
-            value += 6;
-
             h->reqflags |= FLAG_RANGE;
-            h->req_range_start = strtoll(value, &value, 10);
-            h->req_range_end = *value != '\0' ? atoll(value + 1) : 0;
-
-            PRINT_LOG(E_DEBUG, "Range Start-End: %lld - %lld\n",
-                      (long long)h->req_range_start,
-                      h->req_range_end ? (long long)h->req_range_end : -1);
+            if (!parse_byte_ranges(h, value + 6))
+                h->reqflags |= FLAG_INVALID_RANGE;
         }
     }
     // Be strict on host header to prevent DNS rebinding attacks:
@@ -288,6 +375,11 @@ static void parse_http_header(struct upnphttp *h, char *name, char *value, int l
     {
         h->reqflags |= FLAG_CAPTION;
     }
+    else if (strcasecmp(name, "Connection") == 0)
+    {
+        if (strcasestr(value, "close"))
+            h->reqflags |= FLAG_CONN_CLOSE;
+    }
 }
 
 static void send_http_response_helper(struct upnphttp *h, int code, const char *msg)
@@ -380,21 +472,70 @@ static int readline(struct stream *st, char *buf, int limit)
     return -1;
 }
 
-/* Parse and process Http Query
- * called once all the HTTP headers have been received. */
-int process_upnphttp_http_query(int s, int iface)
+/* wait for a pipelined or follow-up request on a kept-alive connection,
+ * the worker is given up early if other connections are queued */
+static int wait_for_next_request(struct upnphttp *h)
 {
-    // allocate a struct
-    struct upnphttp *h = init_upnphttp_struct(s, iface);
+    for (int waited = 0; waited < KEEP_ALIVE_TIMEOUT; waited++)
+    {
+        int r = stream_wait_data(h->st, 1000);
+        if (r != 0)
+            return r > 0;
 
-    if (!h)
-        goto close;
+        if (pending_work() > 0)
+            return 0;
+    }
+    return 0;
+}
+
+/* serve requests on the connection until one of them closes it */
+static void upnphttp_job(void *param)
+{
+    struct upnphttp *h = (struct upnphttp *)param;
 
     // set a 20 second timeout for activity on incoming connections
     struct timeval to = { .tv_sec = 20, .tv_usec = 0 };
     if (setsockopt(stream_fileno(h->st), SOL_SOCKET, SO_RCVTIMEO, &to, sizeof(struct timeval)))
         PRINT_LOG(E_ERROR, "setsockopt(http, SO_RCVTIMEO): %d\n", errno);
 
+    set_traffic_class(stream_fileno(h->st), TRAFFIC_CONTROL);
+
+    while (process_upnphttp_http_query(h)
+           && stream_flush(h->st) == 0
+           && wait_for_next_request(h))
+    {
+        reset_upnphttp_struct(h);
+    }
+
+    delete_upnphttp_struct(h);
+}
+
+/* Hand an accepted connection over to a worker thread so the main loop
+ * only has to accept connections and move SSDP/GENA packets.
+ * Returns 0 if the socket could not be used at all. */
+int dispatch_upnphttp_connection(int s, int iface)
+{
+    struct upnphttp *h = init_upnphttp_struct(s, iface);
+
+    if (!h)
+        return 0;
+
+    // if every worker is busy and the queue is full, ask the client to retry
+    if (queue_work(upnphttp_job, h) != 0)
+    {
+        send_http_response(h, HTTP_SERVICE_UNAVAILABLE_503);
+        delete_upnphttp_struct(h);
+    }
+
+    return 1;
+}
+
+/* Parse and process one Http Query
+ * runs in a worker thread, returns whether the connection can be kept */
+static int process_upnphttp_http_query(struct upnphttp *h)
+{
+    h->requests++;
+
     // get the first line from the buf
     char buf[1024];
     int len = readline(h->st, &buf[0], 1024);
@@ -500,6 +641,9 @@ int process_upnphttp_http_query(int s, int iface)
         goto close;
     }
 
+    // unread headers past the limit would be taken for the next request
+    int headers_complete = len == 0;
+
     // read post message
     // legitimate http requests should be fairly small so reject anything too big
     if (h->data_len != 0 || h->reqflags & FLAG_CHUNKED)
@@ -536,6 +680,13 @@ int process_upnphttp_http_query(int s, int iface)
         goto close;
     }
 
+    // keep the connection unless the client asked otherwise, it has been
+    // used enough or other connections are waiting for a worker
+    h->keep_alive = headers_complete
+        && !(h->reqflags & FLAG_CONN_CLOSE)
+        && h->requests < KEEP_ALIVE_MAX_REQUESTS
+        && pending_work() == 0;
+
     switch (h->req_command)
     {
     case EPost:
@@ -560,7 +711,6 @@ int process_upnphttp_http_query(int s, int iface)
         {
             memmove(h->path, h->path + 11, strlen(h->path) - 10);
             send_resp_dlnafile(h);
-            h = NULL;           // thread handles deallocation
         }
         else if (strncmp(h->path, "/icons/", 7) == 0)
         {
@@ -586,9 +736,10 @@ int process_upnphttp_http_query(int s, int iface)
         break;
     }
 
+    return h->keep_alive;
+
 close:
-    delete_upnphttp_struct(h);
-    return 1;
+    return 0;
 }
 
 /* Respond with response code and response message */
@@ -597,11 +748,11 @@ void send_http_headers(struct upnphttp *h, int respcode, const char *respmsg)
 {
     stream_printf(h->st, "HTTP/1.1 %d %s\r\n"
                   "Content-Type: %s; charset=utf-8\r\n"
-                  "Connection: close\r\n"
-                  "Transfer-Encoding: chunked\r\n"
+                  "Connection: %s\r\n"
                   "Server: " MICRODLNA_SERVER_STRING "\r\n",
                   respcode, respmsg,
-                  (h->respflags & FLAG_HTML) ? "text/html" : "text/xml");
+                  (h->respflags & FLAG_HTML) ? "text/html" : "text/xml",
+                  h->keep_alive ? "keep-alive" : "close");
 
     /* Additional headers */
     if (h->respflags & FLAG_TIMEOUT)
@@ -611,18 +762,22 @@ void send_http_headers(struct upnphttp *h, int respcode, const char *respmsg)
     if (h->respflags & FLAG_SID)
         stream_printf(h->st, "SID: %s\r\n", h->req_sid);
 
+    if (respcode == 503)
+        stream_printf(h->st, "Retry-After: %d\r\n", RETRY_AFTER_SECONDS);
+
     char date[30];
     struct tm buf;
     time_t curtime = time(NULL);
     strftime(date, 30, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&curtime, &buf));
     stream_printf(h->st, "Date: %s\r\n", date);
     stream_printf(h->st, "EXT:\r\n");
-    stream_printf(h->st, "\r\n");
+
+    chunk_print_start(h->st, content_length_responses);
 }
 
 
 static void start_send_http_headers(struct upnphttp *h, int respcode, const char *tmode,
-                                    const struct ext_info *mime)
+                                    const struct ext_info *mime, const char *boundary)
 {
     char date[30];
     struct tm buf;
@@ -630,15 +785,22 @@ static void start_send_http_headers(struct upnphttp *h, int respcode, const char
 
     strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&now, &buf));
 
-    stream_printf(h->st, "HTTP/1.1 %d OK\r\n"
-                  "Connection: close\r\n"
+    stream_printf(h->st, "HTTP/1.1 %d %s\r\n"
+                  "Connection: %s\r\n"
                   "Date: %s\r\n"
                   "Server: " MICRODLNA_SERVER_STRING "\r\n"
                   "EXT:\r\n"
                   "realTimeInfo.dlna.org: DLNA.ORG_TLAG=*\r\n"
-                  "transferMode.dlna.org: %s\r\n"
-                  "Content-Type: %s/%s\r\n",
-                  respcode, date, tmode, mime_type_to_text(mime->type), mime->sub_type);
+                  "transferMode.dlna.org: %s\r\n",
+                  respcode, respcode == 206 ? "Partial Content" : "OK",
+                  h->keep_alive ? "keep-alive" : "close", date, tmode);
+
+    if (boundary)
+        stream_printf(h->st, "Content-Type: multipart/byteranges; boundary=%s\r\n",
+                      boundary);
+    else
+        stream_printf(h->st, "Content-Type: %s/%s\r\n",
+                      mime_type_to_text(mime->type), mime->sub_type);
 }
 
 static void send_resp_icon(struct upnphttp *h)
@@ -682,37 +844,67 @@ static void send_resp_icon(struct upnphttp *h)
         return;
     }
 
-    start_send_http_headers(h, 200, "Interactive", &mime);
+    start_send_http_headers(h, 200, "Interactive", &mime, NULL);
     stream_printf(h->st, "Content-Length: %d\r\n\r\n", size);
 
     if (h->req_command != EHead)
         stream_write(data, size, h->st);
 }
 
-static char *get_srt_path(const char *file_path)
+/* clip the requested ranges to the file, unsatisfiable ones are
+ * dropped, returns how many are left */
+static int resolve_byte_ranges(struct byte_range *ranges, int n, off_t size)
 {
-    int len = strlen(file_path);
-    int end = len > 7 ? len - 7 : 0;
+    int kept = 0;
 
-    for (int i = len - 1; i > end; i--)
+    for (int i = 0; i < n; i++)
     {
-        if (file_path[i] == '.')
+        struct byte_range r = ranges[i];
+
+        if (r.start < 0)
         {
-            char *p = safe_malloc(i + 5);
-            memcpy(p, file_path, i + 1);
-            memcpy(p + i + 1, "srt", 4);
-            return p;
+            if (r.end == 0)
+                continue;
+
+            r.start = r.end < size ? size - r.end : 0;
+            r.end = size - 1;
         }
-        else if (file_path[i] == '/')
-            return NULL;
+        else if (r.end < 0 || r.end >= size)
+        {
+            r.end = size - 1;
+        }
+
+        if (r.start >= size)
+            continue;
+
+        ranges[kept++] = r;
     }
-    return NULL;
+
+    return kept;
 }
 
-static void *serve_file(void *param)
+static void make_boundary(char *boundary)
 {
-    struct upnphttp *h = (struct upnphttp *)param;
-    int sendfh = -1;
+    snprintf(boundary, BOUNDARY_LEN + 1, "%08lx%08lx",
+             random() & 0xffffffff, random() & 0xffffffff);
+}
+
+/* the delimiter and headers in front of one part of a multipart/byteranges
+ * body, returns the length even when buf is too small */
+static int print_part_header(char *buf, size_t len, const char *boundary,
+                             const struct ext_info *mime,
+                             const struct byte_range *r, off_t size)
+{
+    return snprintf(buf, len, "\r\n--%s\r\n"
+                    "Content-Type: %s/%s\r\n"
+                    "Content-Range: bytes %jd-%jd/%jd\r\n\r\n",
+                    boundary, mime_type_to_text(mime->type), mime->sub_type,
+                    (intmax_t)r->start, (intmax_t)r->end, (intmax_t)size);
+}
+
+static void serve_file(struct upnphttp *h)
+{
+    struct cached_file file = { .fd = -1 };
 
     // Path already unescaped in parser (process_upnphttp_http_query); no second unescape here.
     if (!sanitise_path(h->path))
@@ -750,20 +942,17 @@ static void *serve_file(void *param)
         goto error;
     }
 
-    sendfh = open(fullpath, O_RDONLY);
-    if (sendfh < 0)
+    if (filecache_open(h->path, fullpath, &st, &file) < 0)
     {
         PRINT_LOG(E_ERROR, "Error opening %s (errno=%d)\n", fullpath, errno);
         send_http_response(h, HTTP_PAGE_NOT_FOUND_404);
         goto error;
     }
 
-    // get size
-    off_t size = lseek(sendfh, 0, SEEK_END);
-    lseek(sendfh, 0, SEEK_SET);
+    off_t size = file.size;
+    int sendfh = file.fd;
 
-    // get mime type
-    const struct ext_info *mime = get_mime_type(h->path);
+    const struct ext_info *mime = file.mime;
     if (!mime)
     {
         PRINT_LOG(E_ERROR, "Cannot determine mime type for '%s'\n", h->path);
@@ -806,69 +995,64 @@ static void *serve_file(void *param)
     else
         tmode = "Streaming";
 
-    if (h->reqflags & FLAG_RANGE)
+    if (h->reqflags & FLAG_INVALID_RANGE)
     {
-        if (h->req_range_end == 0)
-        {
-            h->req_range_end = size - 1;
-        }
-        if (h->req_range_start > h->req_range_end || h->req_range_start < 0)
-        {
-            PRINT_LOG(E_DEBUG, "Specified range was invalid!\n");
-            send_http_response(h, HTTP_BAD_REQUEST_400);
-            close(sendfh);
-            goto error;
-        }
-        if (h->req_range_end >= size)
+        PRINT_LOG(E_DEBUG, "Specified range was invalid!\n");
+        send_http_response(h, HTTP_BAD_REQUEST_400);
+        goto error;
+    }
+
+    int n_ranges = 0;
+    if ((h->reqflags & FLAG_RANGE) && !(h->reqflags & FLAG_MANY_RANGES))
+    {
+        n_ranges = resolve_byte_ranges(h->req_ranges, h->n_ranges, size);
+        if (n_ranges == 0)
         {
             PRINT_LOG(E_DEBUG, "Specified range was outside file boundaries!\n");
             send_http_response(h, HTTP_INVALID_RANGE_416);
-            close(sendfh);
             goto error;
         }
     }
 
-    start_send_http_headers(h, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, mime);
+    char boundary[BOUNDARY_LEN + 1];
+    if (n_ranges > 1)
+        make_boundary(boundary);
+
+    start_send_http_headers(h, n_ranges > 0 ? 206 : 200, tmode, mime,
+                            n_ranges > 1 ? boundary : NULL);
 
-    off_t total;
-    if (h->reqflags & FLAG_RANGE)
+    const struct byte_range *r = h->req_ranges;
+    if (n_ranges == 0)
+    {
+        stream_printf(h->st, "Content-Length: %jd\r\n", (intmax_t)size);
+    }
+    else if (n_ranges == 1)
     {
-        total = h->req_range_end - h->req_range_start + 1;
         stream_printf(h->st, "Content-Length: %jd\r\n"
                       "Content-Range: bytes %jd-%jd/%jd\r\n",
-                      (intmax_t)total, (intmax_t)h->req_range_start,
-                      (intmax_t)h->req_range_end, (intmax_t)size);
+                      (intmax_t)(r->end - r->start + 1), (intmax_t)r->start,
+                      (intmax_t)r->end, (intmax_t)size);
     }
     else
     {
-        h->req_range_end = size - 1;
-        total = size;
+        off_t total = strlen("\r\n--") + BOUNDARY_LEN + strlen("--\r\n");
+        for (int i = 0; i < n_ranges; i++)
+            total += print_part_header(NULL, 0, boundary, mime, &r[i], size)
+                + r[i].end - r[i].start + 1;
+
         stream_printf(h->st, "Content-Length: %jd\r\n", (intmax_t)total);
     }
 
     // print subtitle header
-    if (h->reqflags & FLAG_CAPTION && mime->type == M_VIDEO)
+    if (h->reqflags & FLAG_CAPTION && file.srt_path)
     {
-        char *srt_file_path = get_srt_path(h->path);
-        if (srt_file_path)
-        {
-            int subs = open(srt_file_path, O_RDONLY);
-            if (subs > -1)
-            {
-                close(subs);
-                const char *escaped_rel_path = url_escape(srt_file_path);
+        const char *escaped_rel_path = url_escape(file.srt_path);
 
-                stream_printf(h->st,
-                              "CaptionInfo.sec: http://%s:%d/MediaItems/%s\r\n",
-                              get_interface_ip_str(h->iface), listening_port,
-                              escaped_rel_path);
-
-                if (escaped_rel_path != srt_file_path)
-                    free((void *)escaped_rel_path);
-            }
+        stream_printf(h->st, "CaptionInfo.sec: http://%s:%d/MediaItems/%s\r\n",
+                      get_interface_ip_str(h->iface), listening_port, escaped_rel_path);
 
-            free(srt_file_path);
-        }
+        if (escaped_rel_path != file.srt_path)
+            free((void *)escaped_rel_path);
     }
 
     uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5 | DLNA_FLAG_HTTP_STALLING | DLNA_FLAG_TM_B;
@@ -882,31 +1066,38 @@ static void *serve_file(void *param)
                   "DLNA.ORG_CI=0;DLNA.ORG_FLAGS=%08X"
                   "000000000000000000000000\r\n\r\n", dlna_flags);
 
-    if (h->req_command != EHead)
+    if (h->req_command == EHead)
+        goto error;
+
+    // run the file transfer, a short transfer leaves the client out of sync
+    if (n_ranges <= 1)
     {
-        // get what we need to run the file transfer
-        int fd = dup(stream_fileno(h->st));
-        if (fd == -1) goto error;
+        off_t start = n_ranges ? r->start : 0;
+        off_t end = n_ranges ? r->end : size - 1;
 
-        off_t start = h->req_range_start;
-        off_t end = h->req_range_end;
+        if (stream_flush_more(h->st) != 0
+            || send_file(stream_fileno(h->st), sendfh, start, end) != 0)
+            h->keep_alive = 0;
+        goto error;
+    }
 
-        // deallocate
-        delete_upnphttp_struct(h);
-        h = NULL;
+    for (int i = 0; i < n_ranges; i++)
+    {
+        char part[256];
+        print_part_header(part, sizeof(part), boundary, mime, &r[i], size);
+        stream_printf(h->st, "%s", part);
 
-        // run the file transfer
-        send_file(fd, sendfh, start, end);
-        close(fd);
+        if (stream_flush_more(h->st) != 0
+            || send_file(stream_fileno(h->st), sendfh, r[i].start, r[i].end) != 0)
+        {
+            h->keep_alive = 0;
+            goto error;
+        }
     }
+    stream_printf(h->st, "\r\n--%s--\r\n", boundary);
 
 error:
-    decrement_thread_count();
-    delete_upnphttp_struct(h);
-    if (sendfh > -1)
-        close(sendfh);
-
-    return NULL;
+    filecache_close(&file);
 }
 
 static void send_resp_dlnafile(struct upnphttp *h)
@@ -916,14 +1107,8 @@ static void send_resp_dlnafile(struct upnphttp *h)
     {
         PRINT_LOG(E_ERROR, "Failed to open media_dir\n");
         send_http_response(h, HTTP_SERVICE_UNAVAILABLE_503);
-        delete_upnphttp_struct(h);
         return;
     }
 
-    // if thread fails, issue error and perform cleanup
-    if (create_thread(serve_file, h) != 0)
-    {
-        send_http_response(h, HTTP_INTERNAL_ERROR_500);
-        delete_upnphttp_struct(h);
-    }
+    serve_file(h);
 }
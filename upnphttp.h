@@ -85,6 +85,16 @@ enum HttpResponseCode
     HTTP_INSUFFICIENT_STORAGE_507,
 };
 
+#define MAX_RANGES 8
+
+/* a requested byte range, a suffix range ("-500") has start -1 and
+ * its length in end, an open-ended range ("500-") has end -1 */
+struct byte_range
+{
+    off_t start;
+    off_t end;
+};
+
 struct upnphttp
 {
     struct stream *st;
@@ -99,6 +109,7 @@ struct upnphttp
     /* soap action */
     void (*req_soap_action)(struct upnphttp *);
     char *remote_dirpath;
+    char *search_criteria;
     int starting_index;
     int requested_count;
 
@@ -109,11 +120,17 @@ struct upnphttp
 
     /* For UNSUBSCRIBE */
     char *req_sid;
-    off_t req_range_start;
-    off_t req_range_end;
+
+    /* Range: bytes=... */
+    struct byte_range req_ranges[MAX_RANGES];
+    int n_ranges;
 
     /* response */
     uint32_t respflags;
+    int keep_alive;
+
+    /* requests served on this connection */
+    int requests;
 };
 
 #define FLAG_TIMEOUT            0x00000001
@@ -131,8 +148,11 @@ struct upnphttp
 #define FLAG_XFERINTERACTIVE    0x00002000
 #define FLAG_XFERBACKGROUND     0x00004000
 #define FLAG_CAPTION            0x00008000
+#define FLAG_CONN_CLOSE         0x00010000
+#define FLAG_INVALID_RANGE      0x00020000
+#define FLAG_MANY_RANGES        0x00040000
 
-int process_upnphttp_http_query(int s, int iface);
+int dispatch_upnphttp_connection(int s, int iface);
 
 void send_http_headers(struct upnphttp *h, int respcode, const char *respmsg);
 
@@ -65,6 +65,8 @@
 #include "mime.h"
 #include "getifaddr.h"
 #include "log.h"
+#include "mediawatch.h"
+#include "search.h"
 #include "upnpdescgen.h"
 #include "upnphttp.h"
 #include "globalvars.h"
@@ -90,6 +92,9 @@
  *                             Defined by UPnP vendor.
  */
 
+/* matches returned by one Search, clients page through the rest */
+#define MAX_SEARCH_RESULTS 1000
+
 #define CONTENT_DIRECTORY_SCHEMAS \
         " xmlns:dc=\"http://purl.org/dc/elements/1.1/\"" \
         " xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\"" \
@@ -282,16 +287,16 @@ void get_protocol_info(struct upnphttp *h)
 {
     send_http_headers(h, 200, "OK");
 
-    CHUNK_PRINT_ALL(h->st,
-                    beforebody,
-                    "<u:GetProtocolInfoResponse "
-                    "xmlns:u=\"urn:schemas-upnp-org:service:ConnectionManager:1\">"
-                    "<Source>");
+    CHUNK_PRINT_STATIC(h->st,
+                       beforebody,
+                       "<u:GetProtocolInfoResponse "
+                       "xmlns:u=\"urn:schemas-upnp-org:service:ConnectionManager:1\">"
+                       "<Source>");
 
     get_resource_protocol_info_values(h->st);
 
-    CHUNK_PRINT_ALL(h->st,
-                    "</Source><Sink></Sink></u:GetProtocolInfoResponse>", afterbody);
+    CHUNK_PRINT_STATIC(h->st,
+                       "</Source><Sink></Sink></u:GetProtocolInfoResponse>", afterbody);
 
     chunk_print_end(h->st);
 }
@@ -300,12 +305,12 @@ void get_sort_capabilities(struct upnphttp *h)
 {
     send_http_headers(h, 200, "OK");
 
-    CHUNK_PRINT_ALL(h->st,
-                    beforebody,
-                    "<u:GetSortCapabilitiesResponse "
-                    "xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
-                    "<SortCaps>dc:title,</SortCaps>"
-                    "</u:GetSortCapabilitiesResponse>", afterbody);
+    CHUNK_PRINT_STATIC(h->st,
+                       beforebody,
+                       "<u:GetSortCapabilitiesResponse "
+                       "xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+                       "<SortCaps>dc:title,</SortCaps>"
+                       "</u:GetSortCapabilitiesResponse>", afterbody);
 
     chunk_print_end(h->st);
 }
@@ -314,31 +319,121 @@ void get_search_capabilities(struct upnphttp *h)
 {
     send_http_headers(h, 200, "OK");
 
-    CHUNK_PRINT_ALL(h->st,
-                    beforebody,
-                    "<u:GetSearchCapabilitiesResponse "
-                    "xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
-                    "<SearchCaps>@id, @parentID, @refID </SearchCaps>"
-                    "</u:GetSearchCapabilitiesResponse>", afterbody);
+    CHUNK_PRINT_STATIC(h->st,
+                       beforebody,
+                       "<u:GetSearchCapabilitiesResponse "
+                       "xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+                       "<SearchCaps>",
+                       enable_search ? "dc:title,upnp:class,@refID"
+                       : "@id, @parentID, @refID ",
+                       "</SearchCaps>"
+                       "</u:GetSearchCapabilitiesResponse>", afterbody);
 
     chunk_print_end(h->st);
 }
 
-static void print_xml_directory_listing(struct upnphttp *h, directory_listing *dl)
+void get_system_update_id(struct upnphttp *h)
 {
     send_http_headers(h, 200, "OK");
 
-    CHUNK_PRINT_ALL(h->st,
-                    beforebody,
-                    "<u:BrowseResponse "
-                    "xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
-                    "<Result>&lt;DIDL-Lite" CONTENT_DIRECTORY_SCHEMAS "&gt;\n");
+    CHUNK_PRINT_STATIC(h->st,
+                       beforebody,
+                       "<u:GetSystemUpdateIDResponse "
+                       "xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">");
 
-    char listening_port_str[7];
+    chunk_printf(h->st, "<Id>%u</Id>", mediawatch_system_update_id());
+
+    CHUNK_PRINT_STATIC(h->st, "</u:GetSystemUpdateIDResponse>", afterbody);
+
+    chunk_print_end(h->st);
+}
+
+static void get_port_str(char *listening_port_str)
+{
     if (listening_port == 80)
         listening_port_str[0] = '\0';
     else
         snprintf(listening_port_str, 6, ":%d", listening_port);
+}
+
+/* one DIDL-Lite container or item, dirpath arguments are already escaped */
+static void print_didl_object(struct upnphttp *h, const char *xml_escaped_dirpath,
+                              const char *url_escaped_dirpath,
+                              const char *listening_port_str, const char *name,
+                              filetype type, off_t size, const struct ext_info *mime)
+{
+    const char *xml_escaped_filename = xml_escape_double(name);
+
+    if (type == T_DIR)
+    {
+        CHUNK_PRINT_ALL(h->st,
+                        "&lt;container id=\"",
+                        xml_escaped_dirpath,
+                        "/",
+                        xml_escaped_filename,
+                        "\" parentID=\"",
+                        xml_escaped_dirpath,
+                        "\" restricted=\"1\" searchable=\"",
+                        enable_search ? "1" : "0",
+                        "\"&gt;&lt;dc:title&gt;",
+                        xml_escaped_filename,
+                        "&lt;/dc:title&gt;&lt;upnp:class"
+                        "&gt;object.container.storageFolder"
+                        "&lt;/upnp:class&gt;&lt;upnp:storageUsed"
+                        "&gt; -1 &lt;/upnp:storageUsed&gt;"
+                        "&lt;/container&gt;");
+    }
+    else if (type == T_FILE)
+    {
+        const char *url_escaped_filename = url_escape(name);
+
+        CHUNK_PRINT_ALL(h->st,
+                        "&lt;item id=\"",
+                        xml_escaped_dirpath,
+                        "/",
+                        xml_escaped_filename,
+                        "\" parentID=\"",
+                        xml_escaped_dirpath,
+                        "\" restricted=\"1\"&gt;&lt;dc:title&gt;",
+                        xml_escaped_filename,
+                        "&lt;/dc:title&gt;&lt;upnp:class&gt;object.item.",
+                        mime_type_to_text(mime->type),
+                        "Item&lt;/upnp:class&gt;");
+
+        chunk_printf(h->st, "&lt;res size=\"%" PRIu64 "\" ", size);
+
+        CHUNK_PRINT_ALL(h->st,
+                        "protocolInfo=\"http-get:*:",
+                        mime_type_to_text(mime->type),
+                        "/",
+                        mime->sub_type,
+                        ":DLNA.ORG_OP=01;DLNA.ORG_CI=0;DLNA.ORG_FLAGS="
+                        "01700000000000000000000000000000\"&gt;http://",
+                        get_interface_ip_str(h->iface),
+                        listening_port_str,
+                        "/MediaItems/",
+                        url_escaped_dirpath,
+                        "/", url_escaped_filename, "&lt;/res&gt;&lt;/item&gt;");
+
+        if (url_escaped_filename != name)
+            free((void *)url_escaped_filename);
+    }
+    if (xml_escaped_filename != name)
+        free((void *)xml_escaped_filename);
+}
+
+static void print_xml_directory_listing(struct upnphttp *h, directory_listing *dl)
+{
+    send_http_headers(h, 200, "OK");
+
+    CHUNK_PRINT_STATIC(h->st,
+                       beforebody,
+                       "<u:BrowseResponse "
+                       "xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+                       "<Result>&lt;DIDL-Lite" CONTENT_DIRECTORY_SCHEMAS "&gt;\n");
+
+    char listening_port_str[7];
+    get_port_str(listening_port_str);
 
     const char *url_escaped_dirpath = url_escape(h->remote_dirpath);
     const char *xml_escaped_dirpath = xml_escape_double(h->remote_dirpath);
@@ -347,62 +442,9 @@ static void print_xml_directory_listing(struct upnphttp *h, directory_listing *d
 
     for (int i = h->starting_index; i < h->starting_index + h->requested_count; i++)
     {
-        const char *xml_escaped_filename = xml_escape_double(dl->entries[i]->name);
-
-        if (dl->entries[i]->type == T_DIR)
-        {
-            CHUNK_PRINT_ALL(h->st,
-                            "&lt;container id=\"",
-                            xml_escaped_dirpath,
-                            "/",
-                            xml_escaped_filename,
-                            "\" parentID=\"",
-                            xml_escaped_dirpath,
-                            "\" restricted=\"1\" searchable=\"0\"&gt;&lt;dc:title&gt;",
-                            xml_escaped_filename,
-                            "&lt;/dc:title&gt;&lt;upnp:class"
-                            "&gt;object.container.storageFolder"
-                            "&lt;/upnp:class&gt;&lt;upnp:storageUsed"
-                            "&gt; -1 &lt;/upnp:storageUsed&gt;"
-                            "&lt;/container&gt;");
-        }
-        else if (dl->entries[i]->type == T_FILE)
-        {
-            const char *url_escaped_filename = url_escape(dl->entries[i]->name);
-
-            CHUNK_PRINT_ALL(h->st,
-                            "&lt;item id=\"",
-                            xml_escaped_dirpath,
-                            "/",
-                            xml_escaped_filename,
-                            "\" parentID=\"",
-                            xml_escaped_dirpath,
-                            "\" restricted=\"1\"&gt;&lt;dc:title&gt;",
-                            xml_escaped_filename,
-                            "&lt;/dc:title&gt;&lt;upnp:class&gt;object.item.",
-                            mime_type_to_text(dl->entries[i]->mime->type),
-                            "Item&lt;/upnp:class&gt;");
-
-            chunk_printf(h->st, "&lt;res size=\"%" PRIu64 "\" ", dl->entries[i]->size);
-
-            CHUNK_PRINT_ALL(h->st,
-                            "protocolInfo=\"http-get:*:",
-                            mime_type_to_text(dl->entries[i]->mime->type),
-                            "/",
-                            dl->entries[i]->mime->sub_type,
-                            ":DLNA.ORG_OP=01;DLNA.ORG_CI=0;DLNA.ORG_FLAGS="
-                            "01700000000000000000000000000000\"&gt;http://",
-                            get_interface_ip_str(h->iface),
-                            listening_port_str,
-                            "/MediaItems/",
-                            url_escaped_dirpath,
-                            "/", url_escaped_filename, "&lt;/res&gt;&lt;/item&gt;");
-
-            if (url_escaped_filename != dl->entries[i]->name)
-                free((void *)url_escaped_filename);
-        }
-        if (xml_escaped_filename != dl->entries[i]->name)
-            free((void *)xml_escaped_filename);
+        print_didl_object(h, xml_escaped_dirpath, url_escaped_dirpath, listening_port_str,
+                          dl->entries[i]->name, dl->entries[i]->type,
+                          dl->entries[i]->size, dl->entries[i]->mime);
     }
 
     if (url_escaped_dirpath != h->remote_dirpath)
@@ -413,10 +455,11 @@ static void print_xml_directory_listing(struct upnphttp *h, directory_listing *d
     chunk_printf(h->st, "&lt;/DIDL-Lite&gt;</Result>\n"
                  "<NumberReturned>%d</NumberReturned>\n"
                  "<TotalMatches>%d</TotalMatches>\n"
-                 "<UpdateID>0</UpdateID>"
-                 "</u:BrowseResponse>", h->requested_count, dl->length);
+                 "<UpdateID>%u</UpdateID>"
+                 "</u:BrowseResponse>", h->requested_count, dl->length,
+                 mediawatch_container_update_id(h->remote_dirpath));
 
-    chunk_print(h->st, afterbody);
+    chunk_print_static(h->st, afterbody);
 
     chunk_print_end(h->st);
 }
@@ -449,6 +492,124 @@ void browse_content_directory(struct upnphttp *h)
     free_directory_listing(&dl);
 }
 
+struct search_output
+{
+    struct upnphttp *h;
+    char listening_port_str[7];
+    int returned;
+};
+
+static void start_search_response(struct upnphttp *h)
+{
+    send_http_headers(h, 200, "OK");
+
+    CHUNK_PRINT_STATIC(h->st,
+                       beforebody,
+                       "<u:SearchResponse "
+                       "xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+                       "<Result>&lt;DIDL-Lite" CONTENT_DIRECTORY_SCHEMAS "&gt;\n");
+}
+
+/* matches are written out as the index is walked */
+static void print_search_hit(void *ctx, const struct search_hit *hit)
+{
+    struct search_output *out = ctx;
+
+    if (out->returned++ == 0)
+        start_search_response(out->h);
+
+    const char *url_escaped_dirpath = url_escape(hit->dirpath);
+    const char *xml_escaped_dirpath = xml_escape_double(hit->dirpath);
+
+    print_didl_object(out->h, xml_escaped_dirpath, url_escaped_dirpath,
+                      out->listening_port_str, hit->name, hit->type, hit->size, hit->mime);
+
+    if (url_escaped_dirpath != hit->dirpath)
+        free((void *)url_escaped_dirpath);
+    if (xml_escaped_dirpath != hit->dirpath)
+        free((void *)xml_escaped_dirpath);
+}
+
+void search_content_directory(struct upnphttp *h)
+{
+    if (!h->remote_dirpath || !h->search_criteria)
+    {
+        soap_error(h, 402, "Invalid Args");
+        return;
+    }
+
+    // a container id of '0' is an alias for the root dir
+    if (strcmp("0", h->remote_dirpath) == 0)
+        h->remote_dirpath[0] = '\0';
+
+    url_unescape(h->remote_dirpath);
+    xml_unescape(h->remote_dirpath);
+    xml_unescape(h->search_criteria);
+
+    if (!sanitise_path(h->remote_dirpath))
+    {
+        soap_error(h, 710, "No such container");
+        return;
+    }
+
+    struct search_query *q = parse_search_criteria(h->search_criteria);
+    if (!q)
+    {
+        PRINT_LOG(E_DEBUG, "Unsupported search criteria: %s\n", h->search_criteria);
+        soap_error(h, 708, "Unsupported or invalid search criteria");
+        return;
+    }
+
+    struct search_index *ix = acquire_search_index();
+    if (!ix)
+    {
+        free_search_query(q);
+        soap_error(h, 720, "Cannot process the request");
+        return;
+    }
+
+    if (h->starting_index < 0)
+        h->starting_index = 0;
+    if (h->requested_count < 1 || h->requested_count > MAX_SEARCH_RESULTS)
+        h->requested_count = MAX_SEARCH_RESULTS;
+
+    PRINT_LOG(E_DEBUG, "Searching ContentDirectory:\n"
+              " * ContainerID: %s\n"
+              " * SearchCriteria: %s\n"
+              " * Count: %d\n"
+              " * StartingIndex: %d\n", h->remote_dirpath, h->search_criteria,
+              h->requested_count, h->starting_index);
+
+    struct search_output out = { .h = h, .returned = 0 };
+    get_port_str(out.listening_port_str);
+
+    int total = search_index_query(ix, h->remote_dirpath, q, h->starting_index,
+                                   h->requested_count, print_search_hit, &out);
+
+    release_search_index(ix);
+    free_search_query(q);
+
+    if (total < 0)
+    {
+        soap_error(h, 710, "No such container");
+        return;
+    }
+
+    if (out.returned == 0)
+        start_search_response(h);
+
+    chunk_printf(h->st, "&lt;/DIDL-Lite&gt;</Result>\n"
+                 "<NumberReturned>%d</NumberReturned>\n"
+                 "<TotalMatches>%d</TotalMatches>\n"
+                 "<UpdateID>%u</UpdateID>"
+                 "</u:SearchResponse>", out.returned, total,
+                 mediawatch_system_update_id());
+
+    chunk_print_static(h->st, afterbody);
+
+    chunk_print_end(h->st);
+}
+
 void unsupported_soap_action(struct upnphttp *h)
 {
     soap_error(h, 708, "Unsupported Action");
@@ -28,12 +28,16 @@ struct upnphttp;
 
 void browse_content_directory(struct upnphttp *);
 
+void search_content_directory(struct upnphttp *);
+
 void unsupported_soap_action(struct upnphttp *);
 
 void get_search_capabilities(struct upnphttp *);
 
 void get_sort_capabilities(struct upnphttp *);
 
+void get_system_update_id(struct upnphttp *);
+
 void get_protocol_info(struct upnphttp *);
 
 void invalid_soap_action(struct upnphttp *);
@@ -15,11 +15,15 @@
  * You should have received a copy of the GNU General Public License
  * along with MicroDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 
 #include "utils.h"
@@ -247,3 +251,58 @@ char *safe_strdup(const char *s)
     memcpy(ptr, s, size);
     return ptr;
 }
+
+int set_non_blocking(int fd, int enable)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+    {
+        PRINT_LOG(E_ERROR, "fcntl(%d, F_GETFL): %d\n", fd, errno);
+        return -1;
+    }
+
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if (fcntl(fd, F_SETFL, flags) < 0)
+    {
+        PRINT_LOG(E_ERROR, "fcntl(%d, F_SETFL): %d\n", fd, errno);
+        return -1;
+    }
+    return 0;
+}
+
+/* unsent bytes a bulk transfer may leave queued in the kernel, the
+ * congestion window grows the socket buffer past this on its own */
+#define BULK_NOTSENT_LOWAT (128 << 10)
+
+static void set_tcp_option(int sd, int option, int value, const char *name)
+{
+    if (setsockopt(sd, IPPROTO_TCP, option, &value, sizeof(value)) < 0)
+        PRINT_LOG(E_DEBUG, "setsockopt(%d, %s): %d\n", sd, name, errno);
+}
+
+void set_traffic_class(int sd, enum traffic_class tc)
+{
+    int bulk = tc == TRAFFIC_BULK;
+
+    /* Control replies leave as soon as their last write is done: the
+     * stream gathers a response into one sendmsg(), so Nagle could only
+     * delay it. Bulk transfers are corked, headers go out with the first
+     * full segment of the file and the tail is pushed on uncorking.
+     * Setting TCP_NODELAY pushes pending data, so it is left alone
+     * while corking. */
+#if defined(TCP_CORK)
+    set_tcp_option(sd, TCP_CORK, bulk, "TCP_CORK");
+#elif defined(TCP_NOPUSH)
+    set_tcp_option(sd, TCP_NOPUSH, bulk, "TCP_NOPUSH");
+#endif
+    if (!bulk)
+        set_tcp_option(sd, TCP_NODELAY, 1, "TCP_NODELAY");
+
+    /* a stream only needs enough queued to cover the network, the rest
+     * stays in the page cache instead of socket memory; 0 goes back to
+     * the system default */
+#ifdef TCP_NOTSENT_LOWAT
+    set_tcp_option(sd, TCP_NOTSENT_LOWAT, bulk ? BULK_NOTSENT_LOWAT : 0,
+                   "TCP_NOTSENT_LOWAT");
+#endif
+}
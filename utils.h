@@ -41,3 +41,15 @@ void *safe_malloc(size_t size);
 void safe_realloc(void **ptr, size_t size);
 
 char *safe_strdup(const char *s);
+
+/* descriptor flags */
+int set_non_blocking(int fd, int enable);
+
+/* TCP tuning of an HTTP connection for what it is about to send */
+enum traffic_class
+{
+    TRAFFIC_CONTROL,            /* small replies, pushed out once complete */
+    TRAFFIC_BULK,               /* media files, full segments, little unsent data */
+};
+
+void set_traffic_class(int sd, enum traffic_class tc);
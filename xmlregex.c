@@ -156,6 +156,11 @@ static void process_name_value_pair(struct upnphttp *h, const char *name,
         if (h->remote_dirpath == NULL)
             h->remote_dirpath = safe_strdup(value);
     }
+    else if (strcmp(name, "SearchCriteria") == 0)
+    {
+        if (h->search_criteria == NULL)
+            h->search_criteria = safe_strdup(value);
+    }
     else if (strcmp(name, "StartingIndex") == 0)
     {
         int n = atoi(value);